@@ -0,0 +1,1118 @@
+#include "coordinate_compression.h"
+#include "graph.h"
+#include "json.h"
+#include "json_scan.h"
+#include "manager.h"
+#include "router.h"
+#include "server.h"
+#include "svg.h"
+
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+template <typename Func>
+double MeasureSeconds(Func func) {
+    const auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Random walk of the given length between neighbouring cells of a side x side grid.
+vector<size_t> GenerateGridWalk(size_t side, size_t length, mt19937& rng) {
+    uniform_int_distribution<size_t> stop_dist(0, side * side - 1);
+    uniform_int_distribution<int> direction_dist(0, 3);
+    vector<size_t> stops = { stop_dist(rng) };
+    while (stops.size() < length) {
+        size_t row = stops.back() / side;
+        size_t col = stops.back() % side;
+        switch (direction_dist(rng)) {
+            case 0: row = row + 1 < side ? row + 1 : row - 1; break;
+            case 1: row = row > 0 ? row - 1 : row + 1; break;
+            case 2: col = col + 1 < side ? col + 1 : col - 1; break;
+            default: col = col > 0 ? col - 1 : col + 1; break;
+        }
+        stops.push_back(row * side + col);
+    }
+    return stops;
+}
+
+// Graph with the same shape as the one BusManager::BuildRoutes() produces: every bus
+// connects every pair of its stops with one edge. Stops sit on a square grid and buses
+// wander between neighbouring cells, so routes have the locality of a real city.
+struct SyntheticCity {
+    size_t stop_count;
+    unique_ptr<Graph::DirectedWeightedGraph<double>> graph;
+};
+
+SyntheticCity GenerateCity(size_t stop_count, size_t bus_count, size_t stops_per_bus, unsigned seed) {
+    mt19937 rng(seed);
+    const size_t side = max<size_t>(2, static_cast<size_t>(sqrt(static_cast<double>(stop_count))));
+    stop_count = side * side;
+    uniform_real_distribution<double> ride_dist(1.0, 3.0);
+    const double wait_time = 6;
+
+    SyntheticCity city{ stop_count, make_unique<Graph::DirectedWeightedGraph<double>>(stop_count) };
+    for (size_t bus = 0; bus < bus_count; ++bus) {
+        vector<size_t> stops = GenerateGridWalk(side, stops_per_bus, rng);
+        vector<double> rides(stops.size() - 1);
+        for (auto& ride : rides) {
+            ride = ride_dist(rng);
+        }
+        // Buses go both ways, like non-roundtrip routes.
+        for (size_t pass = 0; pass < 2; ++pass) {
+            for (size_t first_pos = 0; first_pos + 1 < stops.size(); ++first_pos) {
+                double weight = wait_time;
+                for (size_t second_pos = first_pos + 1; second_pos < stops.size(); ++second_pos) {
+                    weight += rides[second_pos - 1];
+                    city.graph->AddEdge({ stops[first_pos], stops[second_pos], weight });
+                }
+            }
+            reverse(stops.begin(), stops.end());
+            reverse(rides.begin(), rides.end());
+        }
+    }
+    city.graph->Freeze();
+    return city;
+}
+
+void BenchmarkRouters(size_t stop_count, size_t bus_count, size_t stops_per_bus, size_t query_count) {
+    using namespace Graph;
+
+    auto city = GenerateCity(stop_count, bus_count, stops_per_bus, 42);
+    stop_count = city.stop_count;
+    cout << "Routers: " << stop_count << " stops, " << city.graph->GetEdgeCount() << " edges, "
+        << query_count << " queries" << endl;
+
+    mt19937 rng(7);
+    uniform_int_distribution<size_t> stop_dist(0, stop_count - 1);
+    vector<pair<VertexId, VertexId>> queries(query_count);
+    for (auto& [from, to] : queries) {
+        from = stop_dist(rng);
+        to = stop_dist(rng);
+    }
+
+    const vector<pair<string, ERouterMode>> modes = {
+        {"all_pairs", ERouterMode::ALL_PAIRS},
+        {"dijkstra", ERouterMode::DIJKSTRA},
+        {"contraction_hierarchy", ERouterMode::CONTRACTION_HIERARCHY}
+    };
+
+    vector<double> expected_weights;
+    for (const auto& [name, mode] : modes) {
+        if (mode == ERouterMode::ALL_PAIRS && stop_count > 2000) {
+            cout << "  " << setw(22) << left << name << "skipped" << endl;
+            continue;
+        }
+
+        unique_ptr<Router<double>> router;
+        const double build_seconds = MeasureSeconds([&] {
+            router = make_unique<Router<double>>(*city.graph, mode);
+        });
+
+        // The first queries grow the per-thread search buffers; time the steady state.
+        for (size_t i = 0; i < min<size_t>(query_count, 100); ++i) {
+            router->BuildRoute(queries[i].first, queries[i].second);
+        }
+
+        vector<double> weights;
+        weights.reserve(query_count);
+        const double query_seconds = MeasureSeconds([&] {
+            for (const auto& [from, to] : queries) {
+                const auto route = router->BuildRoute(from, to);
+                weights.push_back(route ? route->weight : -1);
+            }
+        });
+
+        size_t mismatch_count = 0;
+        if (expected_weights.empty()) {
+            expected_weights = weights;
+        } else {
+            for (size_t i = 0; i < weights.size(); ++i) {
+                mismatch_count += abs(weights[i] - expected_weights[i]) > 1e-6;
+            }
+        }
+
+        cout << "  " << setw(22) << left << name
+            << "build " << fixed << setprecision(3) << build_seconds << " s, "
+            << "index " << router->GetIndexSize() / 1024 << " KiB, "
+            << "query " << setprecision(2) << query_seconds / query_count * 1e6 << " us"
+            << (mismatch_count ? ", MISMATCHES: " + to_string(mismatch_count) : "") << endl;
+    }
+}
+
+// What BusManager did before adjacency lists: every stop against every earlier one.
+vector<int> CompressCoordinatesQuadratic(const vector<uint32_t>& stop_order,
+    const set<pair<uint32_t, uint32_t>>& neighbour_stops) {
+    vector<int> id_after_compress(stop_order.size(), -1);
+    for (size_t i = 0; i < stop_order.size(); ++i) {
+        int max_neighbour_id = -1;
+        for (size_t j = 0; j < i; ++j) {
+            if (neighbour_stops.count({ stop_order[i], stop_order[j] })) {
+                max_neighbour_id = max(max_neighbour_id, id_after_compress[j]);
+            }
+        }
+        id_after_compress[i] = max_neighbour_id + 1;
+    }
+    return id_after_compress;
+}
+
+// Stops of a grid city with jittered coordinates, compressed along one axis.
+void BenchmarkLayout(size_t stop_count, size_t bus_count, size_t stops_per_bus) {
+    mt19937 rng(42);
+    const size_t side = max<size_t>(2, static_cast<size_t>(sqrt(static_cast<double>(stop_count))));
+    stop_count = side * side;
+    uniform_real_distribution<double> jitter_dist(-0.4, 0.4);
+
+    vector<double> longitudes(stop_count);
+    for (size_t stop = 0; stop < stop_count; ++stop) {
+        longitudes[stop] = stop % side + jitter_dist(rng);
+    }
+
+    StopAdjacency adjacency(stop_count);
+    set<pair<uint32_t, uint32_t>> neighbour_pairs;
+    size_t route_stop_count = 0;
+    for (size_t bus = 0; bus < bus_count; ++bus) {
+        const auto stops = GenerateGridWalk(side, stops_per_bus, rng);
+        route_stop_count += stops.size();
+        for (size_t i = 0; i + 1 < stops.size(); ++i) {
+            AddNeighbours(adjacency, stops[i], stops[i + 1]);
+            neighbour_pairs.insert({ stops[i], stops[i + 1] });
+            neighbour_pairs.insert({ stops[i + 1], stops[i] });
+        }
+    }
+
+    vector<uint32_t> stop_order(stop_count);
+    iota(stop_order.begin(), stop_order.end(), 0);
+    sort(stop_order.begin(), stop_order.end(),
+        [&longitudes](uint32_t lhs, uint32_t rhs) { return longitudes[lhs] < longitudes[rhs]; });
+
+    cout << "Layout: " << stop_count << " stops, " << route_stop_count << " route stops" << endl;
+
+    vector<int> ids;
+    const double adjacency_seconds = MeasureSeconds([&] {
+        SortNeighbours(adjacency);
+        ids = CompressCoordinates(stop_order, adjacency);
+    });
+    cout << "  " << setw(22) << left << "adjacency"
+        << fixed << setprecision(4) << adjacency_seconds << " s, "
+        << "max id " << *max_element(ids.begin(), ids.end()) << endl;
+
+    if (stop_count > 10000) {
+        cout << "  " << setw(22) << left << "quadratic" << "skipped" << endl;
+        return;
+    }
+    vector<int> quadratic_ids;
+    const double quadratic_seconds = MeasureSeconds([&] {
+        quadratic_ids = CompressCoordinatesQuadratic(stop_order, neighbour_pairs);
+    });
+    cout << "  " << setw(22) << left << "quadratic"
+        << fixed << setprecision(4) << quadratic_seconds << " s"
+        << (quadratic_ids != ids ? ", MISMATCH" : "") << endl;
+}
+
+// BusManager input with the given number of stops: coordinates and a few road
+// distances per stop, buses over neighbouring stops and a mix of stat requests,
+// indented like the sample input.
+string GenerateInputJson(size_t stop_count, unsigned seed) {
+    mt19937 rng(seed);
+    uniform_real_distribution<double> coordinate_dist(0, 1);
+    uniform_int_distribution<size_t> stop_dist(0, stop_count - 1);
+    uniform_int_distribution<int> road_dist(300, 5000);
+
+    ostringstream out;
+    out << fixed << setprecision(6);
+    out << "{\n  \"routing_settings\": {\"bus_wait_time\": 6, \"bus_velocity\": 40},\n";
+    out << "  \"base_requests\": [\n";
+    for (size_t stop = 0; stop < stop_count; ++stop) {
+        out << "    {\n      \"type\": \"Stop\",\n      \"name\": \"Stop " << stop << "\",\n"
+            << "      \"latitude\": " << 43.5 + coordinate_dist(rng) << ",\n"
+            << "      \"longitude\": " << 39.7 + coordinate_dist(rng) << ",\n"
+            << "      \"road_distances\": {";
+        for (size_t i = 0; i < 3; ++i) {
+            out << (i ? ", " : "") << "\"Stop " << stop_dist(rng) << "\": " << road_dist(rng);
+        }
+        out << "}\n    },\n";
+    }
+    const size_t bus_count = stop_count / 10 + 1;
+    for (size_t bus = 0; bus < bus_count; ++bus) {
+        out << "    {\n      \"type\": \"Bus\",\n      \"name\": \"" << bus << "\",\n      \"stops\": [";
+        for (size_t i = 0; i < 20; ++i) {
+            out << (i ? ", " : "") << "\"Stop " << stop_dist(rng) << "\"";
+        }
+        out << "],\n      \"is_roundtrip\": " << (bus % 2 ? "true" : "false") << "\n    }"
+            << (bus + 1 < bus_count ? "," : "") << "\n";
+    }
+    out << "  ],\n  \"stat_requests\": [\n";
+    for (size_t request = 0; request < stop_count; ++request) {
+        out << "    {\"id\": " << request << ", \"type\": \"Route\", \"from\": \"Stop " << stop_dist(rng)
+            << "\", \"to\": \"Stop " << stop_dist(rng) << "\"}" << (request + 1 < stop_count ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+void BenchmarkJsonParsing(size_t stop_count) {
+    using namespace Json;
+
+    const string text = GenerateInputJson(stop_count, 42);
+    const double megabytes = text.size() / 1e6;
+    cout << "JSON: " << fixed << setprecision(1) << megabytes << " MB input" << endl;
+
+    const vector<pair<string, EScanKernel>> kernels = {
+        {"scalar", EScanKernel::SCALAR},
+        {"sse2", EScanKernel::SSE2},
+        {"avx2", EScanKernel::AVX2}
+    };
+
+    vector<uint32_t> expected_index;
+    for (const auto& [name, kernel] : kernels) {
+        if (!IsScanKernelSupported(kernel)) {
+            cout << "  " << setw(22) << left << name << "not supported" << endl;
+            continue;
+        }
+
+        vector<uint32_t> index;
+        const double index_seconds = MeasureSeconds([&] {
+            index = BuildStructuralIndex(text, kernel);
+        });
+        if (expected_index.empty()) {
+            expected_index = index;
+        }
+
+        const double parse_seconds = MeasureSeconds([&] {
+            Reader reader(text, kernel);
+            reader.ReadNode();
+        });
+
+        cout << "  " << setw(22) << left << name
+            << "index " << setprecision(0) << megabytes / index_seconds << " MB/s, "
+            << "parse " << megabytes / parse_seconds << " MB/s"
+            << (index != expected_index ? ", INDEX MISMATCH" : "") << endl;
+    }
+
+    // Both DOMs are built from the same reader and torn down inside the measurement.
+    size_t node_count = 0;
+    const double node_seconds = MeasureSeconds([&] {
+        Reader reader(text);
+        const Node root = reader.ReadNode();
+        node_count = root.AsMap().at("base_requests").AsArray().size();
+    });
+    size_t element_count = 0;
+    const double element_seconds = MeasureSeconds([&] {
+        Reader reader(text);
+        Arena arena;
+        const Element& root = reader.ReadElement(arena);
+        element_count = root.AsMap().at("base_requests").AsArray().size();
+    });
+    cout << "  " << setw(22) << left << "dom: Node"
+        << megabytes / node_seconds << " MB/s" << endl;
+    cout << "  " << setw(22) << left << "dom: arena Element"
+        << megabytes / element_seconds << " MB/s"
+        << (element_count != node_count ? ", SIZE MISMATCH" : "") << endl;
+}
+
+// The number loop Json used before ParseNumber(): one multiplication per digit, so
+// it rounds several times and ignores exponents.
+double ParseNumberDigitLoop(string_view text, size_t& pos) {
+    double sign = 1.0;
+    if (text[pos] == '-') {
+        ++pos;
+        sign = -1.0;
+    }
+
+    double result = 0;
+    while (pos < text.size() && isdigit(static_cast<unsigned char>(text[pos]))) {
+        result *= 10;
+        result += static_cast<double>(text[pos++] - '0');
+    }
+
+    if (pos < text.size() && text[pos] == '.') {
+        double coef = 1.0;
+        ++pos;
+        while (pos < text.size() && isdigit(static_cast<unsigned char>(text[pos]))) {
+            coef /= 10;
+            result += coef * static_cast<double>(text[pos++] - '0');
+        }
+    }
+    return result * sign;
+}
+
+// Coordinates as in the inputs, with 6 decimals and at full precision, mixed with
+// integer road distances. Both parsers are checked against strtod.
+void BenchmarkNumberParsing(size_t count) {
+    mt19937 rng(7);
+    uniform_real_distribution<double> coordinate_dist(-90, 90);
+    uniform_int_distribution<int> road_dist(0, 1000000);
+
+    string text;
+    vector<double> expected;
+    char buffer[64];
+    for (size_t i = 0; i < count; ++i) {
+        const int kind = static_cast<int>(i % 3);
+        if (kind == 0) {
+            snprintf(buffer, sizeof(buffer), "%.6f", coordinate_dist(rng));
+        } else if (kind == 1) {
+            snprintf(buffer, sizeof(buffer), "%.17g", coordinate_dist(rng));
+        } else {
+            snprintf(buffer, sizeof(buffer), "%d", road_dist(rng));
+        }
+        expected.push_back(strtod(buffer, nullptr));
+        text += buffer;
+        text += ' ';
+    }
+    const double megabytes = text.size() / 1e6;
+    cout << "Numbers: " << count << ", " << fixed << setprecision(1) << megabytes << " MB" << endl;
+
+    const auto report = [&](const string& name, double seconds, const vector<double>& values) {
+        size_t inexact = 0;
+        for (size_t i = 0; i < count; ++i) {
+            inexact += values[i] != expected[i];
+        }
+        cout << "  " << setw(22) << left << name << setprecision(0) << megabytes / seconds << " MB/s, "
+            << inexact << " inexact" << endl;
+    };
+
+    vector<double> values(count);
+    const double loop_seconds = MeasureSeconds([&] {
+        size_t pos = 0;
+        for (size_t i = 0; i < count; ++i) {
+            values[i] = ParseNumberDigitLoop(text, pos);
+            ++pos;
+        }
+    });
+    report("digit loop", loop_seconds, values);
+
+    const double parse_seconds = MeasureSeconds([&] {
+        size_t pos = 0;
+        for (size_t i = 0; i < count; ++i) {
+            pos += Json::ParseNumber(string_view(text).substr(pos), values[i]) + 1;
+        }
+    });
+    report("ParseNumber", parse_seconds, values);
+}
+
+// Node::Print as it was before Json::Writer: iostream formatting for every value.
+void PrintNodeWithStreams(const Json::Node& node, ostream& os) {
+    if (node.IsDouble()) {
+        const double value = node.AsDouble();
+        if (abs(static_cast<int>(value) - value) < 1e-8) {
+            os << static_cast<int>(round(value));
+        }
+        else {
+            os << fixed << setprecision(6) << value;
+        }
+    }
+    else if (node.IsString()) {
+        os << "\"" << node.AsString() << "\"";
+    }
+    else if (node.IsArray()) {
+        os << "[\n";
+        const auto& items = node.AsArray();
+        for (size_t i = 0; i < items.size(); ++i) {
+            PrintNodeWithStreams(items[i], os);
+            if (i + 1 < items.size()) {
+                os << ",";
+            }
+            os << "\n";
+        }
+        os << "]";
+    }
+    else {
+        os << "{\n";
+        const auto& members = node.AsMap();
+        for (auto it = members.begin(); it != members.end(); ++it) {
+            os << "\"" << it->first << "\": ";
+            PrintNodeWithStreams(it->second, os);
+            if (next(it) != members.end()) {
+                os << ",";
+            }
+            os << "\n";
+        }
+        os << "}";
+    }
+}
+
+// Bus responses printed three ways: a Node tree through iostreams as before, the same
+// tree through Json::Writer, and straight into Json::Writer without a tree.
+void BenchmarkJsonOutput(size_t response_count) {
+    using namespace Json;
+
+    mt19937 rng(11);
+    uniform_real_distribution<double> length_dist(1000, 100000);
+    uniform_int_distribution<int> stop_dist(2, 100);
+    struct BusStats {
+        int stop_count;
+        int unique_stop_count;
+        double route_length;
+        double curvature;
+    };
+    vector<BusStats> stats(response_count);
+    for (auto& bus : stats) {
+        bus = { stop_dist(rng), stop_dist(rng), floor(length_dist(rng)), 1 + length_dist(rng) / 1e5 };
+    }
+
+    const auto build_tree = [&] {
+        vector<Node> responses;
+        for (size_t i = 0; i < stats.size(); ++i) {
+            map<string, Node> response;
+            response["curvature"] = Node(stats[i].curvature);
+            response["request_id"] = Node(static_cast<double>(i));
+            response["route_length"] = Node(stats[i].route_length);
+            response["stop_count"] = Node(static_cast<double>(stats[i].stop_count));
+            response["unique_stop_count"] = Node(static_cast<double>(stats[i].unique_stop_count));
+            responses.emplace_back(move(response));
+        }
+        return Node(move(responses));
+    };
+
+    cout << "Output: " << response_count << " bus responses" << endl;
+    string expected;
+    const auto report = [&](const string& name, double seconds, const string& output) {
+        if (expected.empty()) {
+            expected = output;
+        }
+        cout << "  " << setw(22) << left << name << fixed << setprecision(3) << seconds << " s, "
+            << setprecision(0) << output.size() / 1e6 / seconds << " MB/s"
+            << (output != expected ? ", MISMATCH" : "") << endl;
+    };
+
+    ostringstream streams_out;
+    const double streams_seconds = MeasureSeconds([&] {
+        PrintNodeWithStreams(build_tree(), streams_out);
+    });
+    report("tree + iostream", streams_seconds, streams_out.str());
+
+    ostringstream tree_out;
+    const double tree_seconds = MeasureSeconds([&] {
+        build_tree().Print(tree_out);
+    });
+    report("tree + Writer", tree_seconds, tree_out.str());
+
+    ostringstream writer_out;
+    const double writer_seconds = MeasureSeconds([&] {
+        Writer writer(writer_out);
+        writer.BeginArray();
+        for (size_t i = 0; i < stats.size(); ++i) {
+            writer.BeginObject();
+            writer.Key("curvature");
+            writer.Number(stats[i].curvature);
+            writer.Key("request_id");
+            writer.Number(static_cast<double>(i));
+            writer.Key("route_length");
+            writer.Number(stats[i].route_length);
+            writer.Key("stop_count");
+            writer.Number(stats[i].stop_count);
+            writer.Key("unique_stop_count");
+            writer.Number(stats[i].unique_stop_count);
+            writer.EndObject();
+        }
+        writer.EndArray();
+    });
+    report("Writer", writer_seconds, writer_out.str());
+}
+
+// How Map responses were escaped before Json::Writer::EscapedString: a copy built
+// one character at a time, then copied again into the output.
+string EscapeQuotesByChar(const string& raw_text) {
+    string added_slashes;
+    added_slashes.reserve(raw_text.size());
+    for (const auto ch : raw_text) {
+        if (ch == '"') {
+            added_slashes += '\\';
+        }
+        added_slashes += ch;
+    }
+    return added_slashes;
+}
+
+// A map-sized SVG string printed as a JSON string the given number of times.
+void BenchmarkSvgEscaping(size_t polyline_count, size_t repeat_count) {
+    mt19937 rng(13);
+    uniform_real_distribution<double> coordinate_dist(0, 1000);
+    ostringstream svg;
+    svg << "<?xml version=\"1.0\" encoding=\"UTF-8\" ?><svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\">";
+    for (size_t i = 0; i < polyline_count; ++i) {
+        svg << "<polyline points=\"";
+        for (size_t j = 0; j < 20; ++j) {
+            svg << coordinate_dist(rng) << "," << coordinate_dist(rng) << " ";
+        }
+        svg << "\" fill=\"none\" stroke=\"green\" stroke-width=\"14\" stroke-linecap=\"round\" stroke-linejoin=\"round\" />";
+    }
+    const string text = svg.str();
+    const double megabytes = text.size() * repeat_count / 1e6;
+    cout << "SVG escaping: " << fixed << setprecision(1) << megabytes << " MB" << endl;
+
+    ostringstream copy_out;
+    const double copy_seconds = MeasureSeconds([&] {
+        for (size_t i = 0; i < repeat_count; ++i) {
+            copy_out << '"' << EscapeQuotesByChar(text) << '"';
+        }
+    });
+    ostringstream writer_out;
+    const double writer_seconds = MeasureSeconds([&] {
+        Json::Writer writer(writer_out);
+        for (size_t i = 0; i < repeat_count; ++i) {
+            writer.EscapedString({ text });
+        }
+    });
+    cout << "  " << setw(22) << left << "copy by char" << setprecision(0) << megabytes / copy_seconds << " MB/s" << endl;
+    cout << "  " << setw(22) << left << "Writer" << megabytes / writer_seconds << " MB/s"
+        << (writer_out.str() != copy_out.str() ? ", MISMATCH" : "") << endl;
+}
+
+// PrintKeyValue as it was before the string backend: the stream state is set and
+// the key copied for every attribute.
+template <typename T>
+void PrintKeyValueWithStreams(ostream& os, string key, T value) {
+    os << fixed << setprecision(12) << key << "=\"" << value << "\" ";
+}
+
+// A map the size of a big city drawn twice: through Svg::Document and through the
+// old ostream attribute printing, which has to give the same bytes.
+void BenchmarkSvgRendering(size_t bus_count, size_t stop_count) {
+    mt19937 rng(17);
+    uniform_real_distribution<double> coordinate_dist(0, 1200);
+    uniform_int_distribution<size_t> stop_dist(0, stop_count - 1);
+    const vector<Svg::Color> palette = {
+        Svg::Color("green"), Svg::Rgb(255, 160, 0), Svg::Color("red"), Svg::Rgba(40, 60, 200, 0.85)
+    };
+
+    vector<Svg::Point> stops(stop_count);
+    for (auto& stop : stops) {
+        stop = { coordinate_dist(rng), coordinate_dist(rng) };
+    }
+    // Texts keep views of their data, as they do of the manager's names.
+    vector<string> stop_names(stop_count);
+    for (size_t stop = 0; stop < stop_count; ++stop) {
+        stop_names[stop] = "Stop " + to_string(stop);
+    }
+    vector<vector<size_t>> routes(bus_count);
+    for (auto& route : routes) {
+        for (size_t i = 0; i < 25; ++i) {
+            route.push_back(stop_dist(rng));
+        }
+    }
+
+    Svg::Document document;
+    for (size_t bus = 0; bus < bus_count; ++bus) {
+        Svg::Polyline line = Svg::Polyline{}
+            .SetStrokeColor(palette[bus % palette.size()])
+            .SetStrokeWidth(14)
+            .SetStrokeLineCap("round")
+            .SetStrokeLineJoin("round");
+        for (const size_t stop : routes[bus]) {
+            line.AddPoint(stops[stop]);
+        }
+        document.Add(line);
+    }
+    for (size_t stop = 0; stop < stop_count; ++stop) {
+        document.Add(Svg::Circle{}.SetCenter(stops[stop]).SetRadius(5).SetFillColor("white"));
+        document.Add(Svg::Text{}.SetPoint(stops[stop]).SetOffset({ 7, -3 }).SetFontSize(20)
+            .SetFontFamily("Verdana").SetData(stop_names[stop]).SetFillColor("black"));
+    }
+
+    string rendered;
+    const double render_seconds = MeasureSeconds([&] {
+        document.RenderFigures(rendered);
+    });
+
+    ostringstream streams_out;
+    const double streams_seconds = MeasureSeconds([&] {
+        for (size_t bus = 0; bus < bus_count; ++bus) {
+            streams_out << "<polyline ";
+            PrintKeyValueWithStreams(streams_out, "fill", string("none"));
+            PrintKeyValueWithStreams(streams_out, "stroke", palette[bus % palette.size()].ToString());
+            PrintKeyValueWithStreams(streams_out, "stroke-width", 14.0);
+            PrintKeyValueWithStreams(streams_out, "stroke-linecap", string("round"));
+            PrintKeyValueWithStreams(streams_out, "stroke-linejoin", string("round"));
+            streams_out << "points=\"";
+            for (const size_t stop : routes[bus]) {
+                streams_out << stops[stop].x << "," << stops[stop].y << " ";
+            }
+            streams_out << "\" />";
+        }
+        for (size_t stop = 0; stop < stop_count; ++stop) {
+            streams_out << "<circle ";
+            PrintKeyValueWithStreams(streams_out, "fill", string("white"));
+            PrintKeyValueWithStreams(streams_out, "stroke", string("none"));
+            PrintKeyValueWithStreams(streams_out, "stroke-width", 1.0);
+            PrintKeyValueWithStreams(streams_out, "cx", stops[stop].x);
+            PrintKeyValueWithStreams(streams_out, "cy", stops[stop].y);
+            PrintKeyValueWithStreams(streams_out, "r", 5.0);
+            streams_out << "/>";
+            streams_out << "<text ";
+            PrintKeyValueWithStreams(streams_out, "fill", string("black"));
+            PrintKeyValueWithStreams(streams_out, "stroke", string("none"));
+            PrintKeyValueWithStreams(streams_out, "stroke-width", 1.0);
+            PrintKeyValueWithStreams(streams_out, "x", stops[stop].x);
+            PrintKeyValueWithStreams(streams_out, "y", stops[stop].y);
+            PrintKeyValueWithStreams(streams_out, "dx", 7.0);
+            PrintKeyValueWithStreams(streams_out, "dy", -3.0);
+            PrintKeyValueWithStreams(streams_out, "font-size", 20u);
+            PrintKeyValueWithStreams(streams_out, "font-family", string("Verdana"));
+            streams_out << ">" << "Stop " << stop << "</text>";
+        }
+    });
+
+    const double megabytes = rendered.size() / 1e6;
+    cout << "SVG: " << bus_count << " buses, " << stop_count << " stops, "
+        << fixed << setprecision(1) << megabytes << " MB" << endl;
+    cout << "  " << setw(22) << left << "ostream attributes" << setprecision(0)
+        << megabytes / streams_seconds << " MB/s" << endl;
+    cout << "  " << setw(22) << left << "Svg::Document" << megabytes / render_seconds << " MB/s"
+        << (rendered != streams_out.str() ? ", MISMATCH" : "") << endl;
+}
+
+// BusManager input for a grid city: stops with road distances to the next cells and
+// buses wandering between neighbouring cells.
+struct CityInput {
+    vector<Location> locations;
+    vector<unordered_map<string, double>> distances;
+    vector<vector<size_t>> routes;
+};
+
+string CityStopName(size_t stop) {
+    return "Stop " + to_string(stop);
+}
+
+string CityBusName(size_t bus) {
+    return "Bus " + to_string(bus);
+}
+
+CityInput GenerateCityInput(size_t stop_count, size_t bus_count, size_t stops_per_bus, mt19937& rng) {
+    const size_t side = max<size_t>(2, static_cast<size_t>(sqrt(static_cast<double>(stop_count))));
+    uniform_int_distribution<int> road_dist(300, 3000);
+
+    CityInput city;
+    city.locations.resize(side * side);
+    city.distances.resize(side * side);
+    for (size_t stop = 0; stop < side * side; ++stop) {
+        city.locations[stop] = { 55.5 + 0.5 * (stop / side) / side, 37.3 + 0.6 * (stop % side) / side };
+        if (stop % side + 1 < side) {
+            city.distances[stop][CityStopName(stop + 1)] = road_dist(rng);
+        }
+        if (stop + side < side * side) {
+            city.distances[stop][CityStopName(stop + side)] = road_dist(rng);
+        }
+    }
+    for (size_t bus = 0; bus < bus_count; ++bus) {
+        city.routes.push_back(GenerateGridWalk(side, stops_per_bus, rng));
+    }
+    return city;
+}
+
+BusManager BuildCityManager(const CityInput& city, const BusManagerSettings& settings) {
+    RenderSettings render_settings;
+    render_settings.width = 1200;
+    render_settings.height = 1200;
+    render_settings.padding = 50;
+    render_settings.color_palette = { Svg::Color("green") };
+
+    BusManager manager(settings, render_settings);
+    for (size_t stop = 0; stop < city.locations.size(); ++stop) {
+        manager.AddStop(CityStopName(stop), city.locations[stop], city.distances[stop]);
+    }
+    for (size_t bus = 0; bus < city.routes.size(); ++bus) {
+        vector<string> route;
+        for (const size_t stop : city.routes[bus]) {
+            route.push_back(CityStopName(stop));
+        }
+        manager.AddBus(CityBusName(bus), route, true);
+    }
+    manager.BuildRoutes();
+    return manager;
+}
+
+bool IsSameRoute(const RouteInfoResponse::RouteInfo& lhs, const RouteInfoResponse::RouteInfo& rhs) {
+    if (lhs.Items.size() != rhs.Items.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < lhs.Items.size(); ++i) {
+        const auto& lhs_item = lhs.Items[i];
+        const auto& rhs_item = rhs.Items[i];
+        if (lhs_item.Type != rhs_item.Type || lhs_item.Name != rhs_item.Name
+            || lhs_item.SpanCount != rhs_item.SpanCount || abs(lhs_item.Time - rhs_item.Time) > 1e-6) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Route items in a grid city with more stops than all-pairs precomputation is meant
+// for, where buses sharing streets make many routes equally fast. Default settings must
+// answer exactly like ALL_PAIRS; the other modes only have to agree on times, and the
+// number of ties they resolve differently is printed for reference.
+void BenchmarkRouteTies(size_t stop_count, size_t bus_count, size_t query_count) {
+    using namespace Graph;
+
+    mt19937 rng(11);
+    const CityInput city = GenerateCityInput(stop_count, bus_count, 20, rng);
+    stop_count = city.locations.size();
+    cout << "Route ties: " << stop_count << " stops, " << bus_count << " buses, "
+        << query_count << " queries" << endl;
+
+    uniform_int_distribution<size_t> stop_dist(0, stop_count - 1);
+    vector<pair<string, string>> queries(query_count);
+    for (auto& [from, to] : queries) {
+        from = CityStopName(stop_dist(rng));
+        to = CityStopName(stop_dist(rng));
+    }
+
+    BusManagerSettings all_pairs_settings(6, 40);
+    all_pairs_settings.RouterMode = ERouterMode::ALL_PAIRS;
+    const BusManager expected = BuildCityManager(city, all_pairs_settings);
+
+    const vector<pair<string, optional<ERouterMode>>> configs = {
+        {"default", nullopt},
+        {"dijkstra", ERouterMode::DIJKSTRA},
+        {"contraction_hierarchy", ERouterMode::CONTRACTION_HIERARCHY}
+    };
+    for (const auto& [name, mode] : configs) {
+        BusManagerSettings settings(6, 40);
+        if (mode) {
+            settings.RouterMode = *mode;
+        }
+        const BusManager manager = BuildCityManager(city, settings);
+
+        size_t tie_count = 0;
+        size_t mismatch_count = 0;
+        for (const auto& [from, to] : queries) {
+            const auto expected_info = expected.GetRouteResponse(from, to).Info;
+            const auto info = manager.GetRouteResponse(from, to).Info;
+            if (!expected_info != !info || (info && abs(expected_info->TotalTime - info->TotalTime) > 1e-6)) {
+                ++mismatch_count;
+            } else if (info && !IsSameRoute(*expected_info, *info)) {
+                // Mode-dependent for an explicit mode, a mismatch for the default.
+                ++(mode ? tie_count : mismatch_count);
+            }
+        }
+
+        cout << "  " << setw(22) << left << name
+            << "ties resolved differently " << tie_count
+            << (mismatch_count ? ", MISMATCHES: " + to_string(mismatch_count) : "") << endl;
+    }
+}
+
+// Changes a live database a few times: new road distances, which only retime rides, and
+// new bus routes, which change the graph. Each change is followed by BuildRoutes(), and
+// the result is compared with a database built from scratch out of the changed input.
+void BenchmarkUpdates(size_t stop_count, size_t bus_count, size_t stops_per_bus, size_t update_count) {
+    using namespace Graph;
+
+    mt19937 rng(42);
+    const CityInput original_city = GenerateCityInput(stop_count, bus_count, stops_per_bus, rng);
+    stop_count = original_city.locations.size();
+    const size_t side = static_cast<size_t>(sqrt(static_cast<double>(stop_count)));
+    cout << "Updates: " << stop_count << " stops, " << bus_count << " buses, "
+        << update_count << " updates of each kind" << endl;
+
+    const vector<tuple<string, EGraphModel, ERouterMode>> configs = {
+        {"direct dijkstra", EGraphModel::DIRECT, ERouterMode::DIJKSTRA},
+        {"direct ch", EGraphModel::DIRECT, ERouterMode::CONTRACTION_HIERARCHY},
+        {"layered dijkstra", EGraphModel::LAYERED, ERouterMode::DIJKSTRA}
+    };
+    for (const auto& [name, model, mode] : configs) {
+        // Contraction hierarchies are built anew on every change.
+        if (mode == ERouterMode::CONTRACTION_HIERARCHY && stop_count > 2000) {
+            cout << "  " << setw(22) << left << name << "skipped" << endl;
+            continue;
+        }
+
+        BusManagerSettings settings(6, 40);
+        settings.GraphModel = model;
+        settings.RouterMode = mode;
+        CityInput city = original_city;
+
+        unique_ptr<BusManager> manager;
+        const double build_seconds = MeasureSeconds([&] {
+            manager = make_unique<BusManager>(BuildCityManager(city, settings));
+        });
+
+        uniform_int_distribution<size_t> bus_dist(0, bus_count - 1);
+        uniform_int_distribution<int> road_dist(300, 3000);
+        const double distance_seconds = MeasureSeconds([&] {
+            for (size_t i = 0; i < update_count; ++i) {
+                const auto& route = city.routes[bus_dist(rng)];
+                const size_t pos = uniform_int_distribution<size_t>(1, route.size() - 1)(rng);
+                const double distance = road_dist(rng);
+                manager->SetDistance(CityStopName(route[pos - 1]), CityStopName(route[pos]), distance);
+                manager->BuildRoutes();
+                city.distances[route[pos - 1]][CityStopName(route[pos])] = distance;
+            }
+        });
+        const double route_seconds = MeasureSeconds([&] {
+            for (size_t i = 0; i < update_count; ++i) {
+                const size_t bus = bus_dist(rng);
+                city.routes[bus] = GenerateGridWalk(side, stops_per_bus, rng);
+                vector<string> route;
+                for (const size_t stop : city.routes[bus]) {
+                    route.push_back(CityStopName(stop));
+                }
+                manager->UpdateBus(CityBusName(bus), route, true);
+                manager->BuildRoutes();
+            }
+        });
+
+        const BusManager rebuilt = BuildCityManager(city, settings);
+        uniform_int_distribution<size_t> stop_dist(0, stop_count - 1);
+        size_t mismatch_count = 0;
+        for (size_t i = 0; i < 200; ++i) {
+            const string from = CityStopName(stop_dist(rng));
+            const string to = CityStopName(stop_dist(rng));
+            const auto expected = rebuilt.GetRouteResponse(from, to).Info;
+            const auto actual = manager->GetRouteResponse(from, to).Info;
+            mismatch_count += !expected != !actual || (expected && abs(expected->TotalTime - actual->TotalTime) > 1e-6);
+        }
+        for (size_t bus = 0; bus < bus_count; ++bus) {
+            const auto expected = rebuilt.GetBusInfoResponse(CityBusName(bus)).Info;
+            const auto actual = manager->GetBusInfoResponse(CityBusName(bus)).Info;
+            mismatch_count += abs(expected->PathLength - actual->PathLength) > 1e-6;
+        }
+
+        cout << "  " << setw(22) << left << name
+            << "build " << fixed << setprecision(3) << build_seconds * 1e3 << " ms, "
+            << "distance " << distance_seconds / update_count * 1e3 << " ms, "
+            << "route " << route_seconds / update_count * 1e3 << " ms"
+            << (mismatch_count ? ", MISMATCHES: " + to_string(mismatch_count) : "") << endl;
+    }
+}
+
+// Route queries whose origins follow a Zipf law with the given exponent, as when many
+// trips start at a few hubs, answered one by one and grouped by origin.
+void BenchmarkRouteBatches(size_t stop_count, size_t bus_count, size_t query_count) {
+    using namespace Graph;
+
+    mt19937 rng(23);
+    const CityInput city = GenerateCityInput(stop_count, bus_count, 25, rng);
+    stop_count = city.locations.size();
+    cout << "Route batches: " << stop_count << " stops, " << bus_count << " buses, "
+        << query_count << " queries" << endl;
+
+    for (const EGraphModel model : { EGraphModel::DIRECT, EGraphModel::LAYERED }) {
+        BusManagerSettings settings(6, 40);
+        settings.GraphModel = model;
+        settings.RouterMode = ERouterMode::DIJKSTRA;
+        const BusManager manager = BuildCityManager(city, settings);
+        // Renders the base map, which both ways share.
+        manager.GetMapInfoResponse();
+
+        for (const double exponent : { 0.0, 1.0, 1.5 }) {
+            vector<double> origin_weights(stop_count);
+            for (size_t rank = 0; rank < stop_count; ++rank) {
+                origin_weights[rank] = pow(rank + 1.0, -exponent);
+            }
+            discrete_distribution<size_t> origin_dist(origin_weights.begin(), origin_weights.end());
+            uniform_int_distribution<size_t> stop_dist(0, stop_count - 1);
+            vector<pair<string, string>> queries;
+            for (size_t i = 0; i < query_count; ++i) {
+                queries.emplace_back(CityStopName(origin_dist(rng)), CityStopName(stop_dist(rng)));
+            }
+
+            vector<double> single_times;
+            const double single_seconds = MeasureSeconds([&] {
+                for (const auto& [from, to] : queries) {
+                    const auto info = manager.GetRouteResponse(from, to).Info;
+                    single_times.push_back(info ? info->TotalTime : -1);
+                }
+            });
+
+            vector<double> batch_times(query_count);
+            size_t origin_count = 0;
+            const double batch_seconds = MeasureSeconds([&] {
+                unordered_map<string, vector<size_t>> idxs_by_from;
+                for (size_t i = 0; i < query_count; ++i) {
+                    idxs_by_from[queries[i].first].push_back(i);
+                }
+                origin_count = idxs_by_from.size();
+                for (const auto& [from, idxs] : idxs_by_from) {
+                    vector<string> stops_to;
+                    for (const size_t i : idxs) {
+                        stops_to.push_back(queries[i].second);
+                    }
+                    const auto responses = manager.GetRouteResponses(from, stops_to);
+                    for (size_t k = 0; k < idxs.size(); ++k) {
+                        batch_times[idxs[k]] = responses[k].Info ? responses[k].Info->TotalTime : -1;
+                    }
+                }
+            });
+
+            const string name = string(model == EGraphModel::DIRECT ? "direct" : "layered")
+                + ", zipf " + to_string(exponent).substr(0, 3);
+            cout << "  " << setw(22) << left << name << setw(6) << origin_count << "origins, "
+                << fixed << setprecision(0) << "one by one " << query_count / single_seconds << " queries/s, "
+                << "batched " << query_count / batch_seconds << " queries/s"
+                << (batch_times != single_times ? ", MISMATCH" : "") << endl;
+        }
+    }
+}
+
+#ifdef __linux__
+// A client that sends one request line and waits for its response before the next.
+class BlockingClient {
+public:
+    explicit BlockingClient(const string& socket_path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        socket_path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+            throw runtime_error("Cannot connect to " + socket_path);
+        }
+    }
+
+    ~BlockingClient() {
+        close(fd_);
+    }
+
+    string Ask(const string& line) {
+        for (size_t sent = 0; sent < line.size(); ) {
+            const ssize_t result = send(fd_, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+            if (result <= 0) {
+                throw runtime_error("send failed");
+            }
+            sent += result;
+        }
+        while (true) {
+            const size_t line_end = input_.find('\n');
+            if (line_end != string::npos) {
+                string response = input_.substr(0, line_end);
+                input_.erase(0, line_end + 1);
+                return response;
+            }
+            char chunk[4096];
+            const ssize_t received = recv(fd_, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
+                throw runtime_error("recv failed");
+            }
+            input_.append(chunk, received);
+        }
+    }
+
+private:
+    int fd_;
+    string input_;
+};
+
+// Route queries against a served city from several clients at once, each waiting for
+// a response before sending the next request, so the percentiles are round trips
+// through the socket, the event loop and the pool.
+void BenchmarkServer(size_t stop_count, size_t client_count, size_t query_count) {
+    mt19937 rng(5);
+    const CityInput city = GenerateCityInput(stop_count, stop_count / 8, 20, rng);
+    stop_count = city.locations.size();
+    BusManagerSettings settings(6, 40);
+    settings.RouterMode = Graph::ERouterMode::DIJKSTRA;
+    BusManager manager = BuildCityManager(city, settings);
+    ThreadPool pool;
+    manager.SetThreadPool(&pool);
+
+    const string socket_path = "/tmp/bus_manager_benchmark_" + to_string(getpid()) + ".sock";
+    Server server(socket_path, pool, [&](string_view request) {
+        const size_t space = request.find(' ');
+        const auto info = manager.GetRouteResponse(string(request.substr(0, space)), string(request.substr(space + 1))).Info;
+        return info ? to_string(info->TotalTime) : string("not found");
+    });
+    thread loop([&] { server.Run(); });
+
+    vector<vector<double>> latencies(client_count);
+    vector<thread> clients;
+    const double seconds = MeasureSeconds([&] {
+        for (size_t client = 0; client < client_count; ++client) {
+            clients.emplace_back([&, client] {
+                mt19937 client_rng(client);
+                uniform_int_distribution<size_t> stop_dist(0, stop_count - 1);
+                BlockingClient connection(socket_path);
+                for (size_t i = 0; i < query_count; ++i) {
+                    const string line = CityStopName(stop_dist(client_rng)) + " " + CityStopName(stop_dist(client_rng)) + "\n";
+                    latencies[client].push_back(MeasureSeconds([&] { connection.Ask(line); }));
+                }
+            });
+        }
+        for (auto& client : clients) {
+            client.join();
+        }
+    });
+    server.Stop();
+    loop.join();
+
+    vector<double> all;
+    for (const auto& client_latencies : latencies) {
+        all.insert(all.end(), client_latencies.begin(), client_latencies.end());
+    }
+    sort(all.begin(), all.end());
+    const auto percentile = [&](double p) {
+        return all[min(all.size() - 1, static_cast<size_t>(p * all.size()))] * 1e6;
+    };
+    cout << "Server: " << stop_count << " stops, " << client_count << " clients, "
+        << all.size() << " route queries" << endl;
+    cout << "  " << fixed << setprecision(0) << all.size() / seconds << " queries/s, "
+        << "p50 " << percentile(0.5) << " us, p99 " << percentile(0.99) << " us, "
+        << "max " << all.back() * 1e6 << " us" << endl;
+}
+#endif
+
+int main(int argc, char** argv) {
+    const string suite = argc > 1 ? argv[1] : "all";
+    if (suite == "all" || suite == "routers") {
+        BenchmarkRouters(300, 60, 15, 10000);
+        BenchmarkRouters(1600, 250, 20, 10000);
+        BenchmarkRouters(10000, 1200, 25, 2000);
+        BenchmarkRouteTies(400, 100, 5000);
+    }
+    if (suite == "all" || suite == "layout") {
+        BenchmarkLayout(1000, 100, 20);
+        BenchmarkLayout(5000, 500, 30);
+        BenchmarkLayout(50000, 5000, 40);
+    }
+    if (suite == "all" || suite == "json") {
+        BenchmarkJsonParsing(200000);
+    }
+    if (suite == "all" || suite == "numbers") {
+        BenchmarkNumberParsing(3000000);
+    }
+    if (suite == "all" || suite == "output") {
+        BenchmarkJsonOutput(1000000);
+        BenchmarkSvgEscaping(5000, 50);
+    }
+    if (suite == "all" || suite == "svg") {
+        BenchmarkSvgRendering(20000, 200000);
+    }
+    if (suite == "all" || suite == "updates") {
+        BenchmarkUpdates(1600, 250, 20, 10);
+        BenchmarkUpdates(10000, 1200, 25, 10);
+    }
+    if (suite == "all" || suite == "batches") {
+        BenchmarkRouteBatches(10000, 1200, 3000);
+    }
+#ifdef __linux__
+    if (suite == "all" || suite == "server") {
+        BenchmarkServer(1600, 1, 20000);
+        BenchmarkServer(1600, 8, 5000);
+    }
+#endif
+    return 0;
+}
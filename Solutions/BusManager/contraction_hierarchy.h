@@ -0,0 +1,506 @@
+#pragma once
+
+#include "graph.h"
+#include "search_scratch.h"
+#include "serialization.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // Contraction hierarchy over a DirectedWeightedGraph. Vertices are contracted one by
+    // one in order of importance; whenever removing a vertex would break a shortest path
+    // between two of its neighbours, a shortcut edge is added. A query then only needs two
+    // small Dijkstra searches that go "upward" in the order, from both ends.
+    //
+    // Edges of the original graph keep their ids; shortcuts get ids after them and are
+    // unpacked back into original edges when a route is built.
+    template <typename Weight>
+    class ContractionHierarchy {
+    private:
+        using Graph = DirectedWeightedGraph<Weight>;
+
+    public:
+        explicit ContractionHierarchy(const Graph& graph);
+        explicit ContractionHierarchy(Serialization::Reader& in);
+
+        void Serialize(std::ostream& out) const;
+
+        // Fills edges with original edge ids of the shortest path from -> to.
+        std::optional<Weight> FindRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+
+        size_t GetVertexCount() const {
+            return rank_.size();
+        }
+
+        size_t GetOriginalEdgeCount() const {
+            return original_edge_count_;
+        }
+
+        size_t GetShortcutCount() const {
+            return edges_.size() - original_edge_count_;
+        }
+
+        size_t GetIndexSize() const {
+            return edges_.size() * sizeof(ChEdge)
+                + (up_arcs_.size() + down_arcs_.size()) * sizeof(Arc)
+                + (up_offsets_.size() + down_offsets_.size()) * sizeof(size_t);
+        }
+
+    private:
+        struct ChEdge {
+            VertexId from;
+            VertexId to;
+            Weight weight;
+            // Shortcuts are made of two edges (from -> via, via -> to); originals have none.
+            EdgeId first = NO_EDGE;
+            EdgeId second = NO_EDGE;
+        };
+
+        struct Arc {
+            VertexId to;
+            Weight weight;
+            EdgeId edge_id;
+        };
+
+        // Neighbour of a vertex in the graph that is still being contracted.
+        struct WorkArc {
+            VertexId vertex;
+            EdgeId edge_id;
+        };
+
+        struct ContractionState {
+            std::vector<std::vector<WorkArc>> out_arcs;
+            std::vector<std::vector<WorkArc>> in_arcs;
+            std::vector<bool> contracted;
+            std::vector<int> contracted_neighbours;
+            SearchScratch<Weight> witness_scratch;
+        };
+
+        struct ShortcutCandidate {
+            VertexId from;
+            VertexId to;
+            Weight weight;
+            EdgeId first;
+            EdgeId second;
+        };
+
+        // Witness searches give up after settling this many vertices; an extra shortcut
+        // is harmless, a long search on every contraction is not.
+        static constexpr size_t WITNESS_SETTLED_LIMIT = 64;
+
+        size_t original_edge_count_ = 0;
+        std::vector<ChEdge> edges_;
+        std::vector<uint32_t> rank_;
+
+        // Upward arcs for the forward search, stored at the lower endpoint.
+        std::vector<size_t> up_offsets_;
+        std::vector<Arc> up_arcs_;
+        // Edges u -> v with rank[u] > rank[v], stored reversed at v for the backward search.
+        std::vector<size_t> down_offsets_;
+        std::vector<Arc> down_arcs_;
+
+        void AddWorkEdge(ContractionState& state, EdgeId edge_id);
+        void CollectShortcuts(ContractionState& state, VertexId vertex, std::vector<ShortcutCandidate>& shortcuts);
+        void RunWitnessSearch(ContractionState& state, VertexId from, VertexId excluded, Weight limit);
+        int ComputePriority(ContractionState& state, VertexId vertex, std::vector<ShortcutCandidate>& shortcuts);
+        void Contract(ContractionState& state, VertexId vertex, std::vector<ShortcutCandidate>& shortcuts);
+        void BuildSearchGraphs(size_t vertex_count);
+        // Checks the arcs stored at each vertex against the edges they stand for.
+        void CheckSearchGraph(const std::vector<size_t>& offsets, const std::vector<Arc>& arcs, bool is_upward) const;
+        void UnpackEdge(EdgeId edge_id, std::vector<EdgeId>& stack, std::vector<EdgeId>& edges) const;
+
+        // Kept per thread and cleared by every query, so after warming up queries
+        // allocate nothing.
+        struct QueryScratch {
+            SearchScratch<Weight> forward;
+            SearchScratch<Weight> backward;
+            // Hierarchy edges of the route, shortcuts still packed.
+            std::vector<EdgeId> ch_edges;
+            std::vector<EdgeId> unpack_stack;
+        };
+
+        static QueryScratch& GetQueryScratch() {
+            thread_local QueryScratch scratch;
+            return scratch;
+        }
+    };
+
+
+    template <typename Weight>
+    ContractionHierarchy<Weight>::ContractionHierarchy(const Graph& graph)
+        : original_edge_count_(graph.GetEdgeCount())
+    {
+        const size_t vertex_count = graph.GetVertexCount();
+
+        ContractionState state;
+        state.out_arcs.resize(vertex_count);
+        state.in_arcs.resize(vertex_count);
+        state.contracted.assign(vertex_count, false);
+        state.contracted_neighbours.assign(vertex_count, 0);
+
+        edges_.reserve(graph.GetEdgeCount());
+        for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+            const auto& edge = graph.GetEdge(edge_id);
+            assert(edge.weight >= 0);
+            edges_.push_back({ edge.from, edge.to, edge.weight });
+            if (edge.from != edge.to) {
+                AddWorkEdge(state, edge_id);
+            }
+        }
+
+        using QueueItem = std::pair<int, VertexId>;
+        std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+        std::vector<ShortcutCandidate> shortcuts;
+        for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+            queue.push({ ComputePriority(state, vertex, shortcuts), vertex });
+        }
+
+        rank_.assign(vertex_count, 0);
+        uint32_t next_rank = 0;
+        while (!queue.empty()) {
+            const VertexId vertex = queue.top().second;
+            queue.pop();
+            // Lazy update: priorities go stale as neighbours are contracted.
+            const int priority = ComputePriority(state, vertex, shortcuts);
+            if (!queue.empty() && priority > queue.top().first) {
+                queue.push({ priority, vertex });
+                continue;
+            }
+            Contract(state, vertex, shortcuts);
+            rank_[vertex] = next_rank++;
+        }
+
+        BuildSearchGraphs(vertex_count);
+    }
+
+    // Shortcuts only refer to edges before them, which makes unpacking finish. Arcs have
+    // to match their edges and lead up in rank, so that both searches stay acyclic.
+    template <typename Weight>
+    ContractionHierarchy<Weight>::ContractionHierarchy(Serialization::Reader& in) {
+        using Serialization::Deserialize;
+        Deserialize(in, original_edge_count_);
+        Deserialize(in, edges_);
+        Deserialize(in, rank_);
+        Deserialize(in, up_offsets_);
+        Deserialize(in, up_arcs_);
+        Deserialize(in, down_offsets_);
+        Deserialize(in, down_arcs_);
+
+        using Serialization::Check;
+        const size_t vertex_count = rank_.size();
+        Check(original_edge_count_ <= edges_.size(), "Serialized hierarchy has a bad edge count");
+        for (EdgeId edge_id = 0; edge_id < edges_.size(); ++edge_id) {
+            const auto& edge = edges_[edge_id];
+            Check(edge.from < vertex_count && edge.to < vertex_count, "Serialized hierarchy has an edge to a missing vertex");
+            if (edge_id < original_edge_count_) {
+                Check(edge.first == NO_EDGE && edge.second == NO_EDGE, "Serialized hierarchy has a packed original edge");
+            } else {
+                Check(edge.first < edge_id && edge.second < edge_id, "Serialized hierarchy has a bad shortcut");
+            }
+        }
+        for (const uint32_t rank : rank_) {
+            Check(rank < vertex_count, "Serialized hierarchy has a bad rank");
+        }
+        CheckSearchGraph(up_offsets_, up_arcs_, true);
+        CheckSearchGraph(down_offsets_, down_arcs_, false);
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::CheckSearchGraph(const std::vector<size_t>& offsets,
+        const std::vector<Arc>& arcs, bool is_upward) const {
+        using Serialization::Check;
+        const size_t vertex_count = rank_.size();
+        Check(offsets.size() == vertex_count + 1 && offsets.front() == 0 && offsets.back() == arcs.size(),
+            "Serialized hierarchy has bad arc offsets");
+        for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+            Check(offsets[vertex] <= offsets[vertex + 1], "Serialized hierarchy has decreasing arc offsets");
+            for (size_t idx = offsets[vertex]; idx < offsets[vertex + 1]; ++idx) {
+                const auto& arc = arcs[idx];
+                Check(arc.edge_id < edges_.size(), "Serialized hierarchy has an arc of a missing edge");
+                const auto& edge = edges_[arc.edge_id];
+                Check(arc.to < vertex_count && rank_[vertex] < rank_[arc.to]
+                    && (is_upward
+                        ? edge.from == vertex && edge.to == arc.to
+                        : edge.to == vertex && edge.from == arc.to),
+                    "Serialized hierarchy has an arc that does not match its edge");
+            }
+        }
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::Serialize(std::ostream& out) const {
+        using Serialization::Serialize;
+        Serialize(original_edge_count_, out);
+        Serialize(edges_, out);
+        Serialize(rank_, out);
+        Serialize(up_offsets_, out);
+        Serialize(up_arcs_, out);
+        Serialize(down_offsets_, out);
+        Serialize(down_arcs_, out);
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::AddWorkEdge(ContractionState& state, EdgeId edge_id) {
+        const auto& edge = edges_[edge_id];
+        // Keep only the lightest edge between two vertices.
+        auto& out_arcs = state.out_arcs[edge.from];
+        auto it = std::find_if(out_arcs.begin(), out_arcs.end(),
+            [&edge](const WorkArc& arc) { return arc.vertex == edge.to; });
+        if (it != out_arcs.end()) {
+            if (!(edge.weight < edges_[it->edge_id].weight)) {
+                return;
+            }
+            it->edge_id = edge_id;
+            for (auto& in_arc : state.in_arcs[edge.to]) {
+                if (in_arc.vertex == edge.from) {
+                    in_arc.edge_id = edge_id;
+                }
+            }
+            return;
+        }
+        out_arcs.push_back({ edge.to, edge_id });
+        state.in_arcs[edge.to].push_back({ edge.from, edge_id });
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::RunWitnessSearch(ContractionState& state, VertexId from,
+        VertexId excluded, Weight limit) {
+        auto& scratch = state.witness_scratch;
+        scratch.Reset(state.out_arcs.size());
+        scratch.Reach(from, 0, NO_EDGE);
+        scratch.Push(0, from);
+
+        size_t settled_count = 0;
+        typename SearchScratch<Weight>::QueueItem item;
+        while (scratch.PopSettled(item)) {
+            const auto [weight, vertex] = item;
+            if (limit < weight || ++settled_count > WITNESS_SETTLED_LIMIT) {
+                return;
+            }
+            for (const auto& arc : state.out_arcs[vertex]) {
+                if (arc.vertex != excluded && !state.contracted[arc.vertex]) {
+                    scratch.Relax(arc.vertex, weight + edges_[arc.edge_id].weight, arc.edge_id);
+                }
+            }
+        }
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::CollectShortcuts(ContractionState& state, VertexId vertex,
+        std::vector<ShortcutCandidate>& shortcuts) {
+        shortcuts.clear();
+        const auto& out_arcs = state.out_arcs[vertex];
+        for (const auto& in_arc : state.in_arcs[vertex]) {
+            if (state.contracted[in_arc.vertex]) {
+                continue;
+            }
+            const Weight in_weight = edges_[in_arc.edge_id].weight;
+
+            std::optional<Weight> limit;
+            for (const auto& out_arc : out_arcs) {
+                if (!state.contracted[out_arc.vertex] && out_arc.vertex != in_arc.vertex) {
+                    const Weight shortcut_weight = in_weight + edges_[out_arc.edge_id].weight;
+                    if (!limit || *limit < shortcut_weight) {
+                        limit = shortcut_weight;
+                    }
+                }
+            }
+            if (!limit) {
+                continue;
+            }
+
+            // One search from the in-neighbour serves all out-neighbours; a distance that
+            // is only an upper bound is still a valid witness.
+            RunWitnessSearch(state, in_arc.vertex, vertex, *limit);
+            const auto& scratch = state.witness_scratch;
+            for (const auto& out_arc : out_arcs) {
+                if (state.contracted[out_arc.vertex] || out_arc.vertex == in_arc.vertex) {
+                    continue;
+                }
+                const Weight shortcut_weight = in_weight + edges_[out_arc.edge_id].weight;
+                if (!scratch.IsReached(out_arc.vertex) || shortcut_weight < scratch.weights[out_arc.vertex]) {
+                    shortcuts.push_back({ in_arc.vertex, out_arc.vertex, shortcut_weight,
+                        in_arc.edge_id, out_arc.edge_id });
+                }
+            }
+        }
+    }
+
+    template <typename Weight>
+    int ContractionHierarchy<Weight>::ComputePriority(ContractionState& state, VertexId vertex,
+        std::vector<ShortcutCandidate>& shortcuts) {
+        CollectShortcuts(state, vertex, shortcuts);
+        int removed_count = 0;
+        for (const auto& arc : state.in_arcs[vertex]) {
+            removed_count += !state.contracted[arc.vertex];
+        }
+        for (const auto& arc : state.out_arcs[vertex]) {
+            removed_count += !state.contracted[arc.vertex];
+        }
+        // Edge difference plus a term that spreads contraction evenly over the graph.
+        return static_cast<int>(shortcuts.size()) - removed_count + state.contracted_neighbours[vertex];
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::Contract(ContractionState& state, VertexId vertex,
+        std::vector<ShortcutCandidate>& shortcuts) {
+        // ComputePriority has just filled shortcuts for this vertex.
+        for (const auto& shortcut : shortcuts) {
+            edges_.push_back({ shortcut.from, shortcut.to, shortcut.weight, shortcut.first, shortcut.second });
+            AddWorkEdge(state, edges_.size() - 1);
+        }
+        state.contracted[vertex] = true;
+        for (const auto& arc : state.in_arcs[vertex]) {
+            ++state.contracted_neighbours[arc.vertex];
+        }
+        for (const auto& arc : state.out_arcs[vertex]) {
+            ++state.contracted_neighbours[arc.vertex];
+        }
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::BuildSearchGraphs(size_t vertex_count) {
+        up_offsets_.assign(vertex_count + 1, 0);
+        down_offsets_.assign(vertex_count + 1, 0);
+        for (const auto& edge : edges_) {
+            if (edge.from == edge.to) {
+                continue;
+            }
+            if (rank_[edge.from] < rank_[edge.to]) {
+                ++up_offsets_[edge.from + 1];
+            } else {
+                ++down_offsets_[edge.to + 1];
+            }
+        }
+        for (size_t vertex = 0; vertex < vertex_count; ++vertex) {
+            up_offsets_[vertex + 1] += up_offsets_[vertex];
+            down_offsets_[vertex + 1] += down_offsets_[vertex];
+        }
+
+        up_arcs_.resize(up_offsets_.back());
+        down_arcs_.resize(down_offsets_.back());
+        std::vector<size_t> up_fill(up_offsets_.begin(), up_offsets_.end() - 1);
+        std::vector<size_t> down_fill(down_offsets_.begin(), down_offsets_.end() - 1);
+        for (EdgeId edge_id = 0; edge_id < edges_.size(); ++edge_id) {
+            const auto& edge = edges_[edge_id];
+            if (edge.from == edge.to) {
+                continue;
+            }
+            if (rank_[edge.from] < rank_[edge.to]) {
+                up_arcs_[up_fill[edge.from]++] = { edge.to, edge.weight, edge_id };
+            } else {
+                down_arcs_[down_fill[edge.to]++] = { edge.from, edge.weight, edge_id };
+            }
+        }
+    }
+
+    template <typename Weight>
+    std::optional<Weight> ContractionHierarchy<Weight>::FindRoute(VertexId from, VertexId to,
+        std::vector<EdgeId>& edges) const {
+        edges.clear();
+        if (from == to) {
+            return Weight{};
+        }
+
+        auto& [forward, backward, ch_edges, unpack_stack] = GetQueryScratch();
+        const size_t vertex_count = rank_.size();
+        forward.Reset(vertex_count);
+        backward.Reset(vertex_count);
+        forward.Reach(from, 0, NO_EDGE);
+        forward.Push(0, from);
+        backward.Reach(to, 0, NO_EDGE);
+        backward.Push(0, to);
+
+        std::optional<Weight> best_weight;
+        VertexId meeting_vertex = from;
+
+        // Each direction relaxes its own upward arcs and looks at the other direction's
+        // arcs only for stall-on-demand: a vertex reachable more cheaply from above is not
+        // on a shortest up-down path, so its arcs need not be relaxed.
+        auto step = [&](SearchScratch<Weight>& scratch, const SearchScratch<Weight>& other,
+            const std::vector<size_t>& offsets, const std::vector<Arc>& arcs,
+            const std::vector<size_t>& stall_offsets, const std::vector<Arc>& stall_arcs) {
+            typename SearchScratch<Weight>::QueueItem item;
+            if (!scratch.PopSettled(item)) {
+                return;
+            }
+            const auto [weight, vertex] = item;
+            if (best_weight && !(weight < *best_weight)) {
+                scratch.heap.clear();
+                return;
+            }
+            if (other.IsReached(vertex)) {
+                const Weight candidate = weight + other.weights[vertex];
+                if (!best_weight || candidate < *best_weight) {
+                    best_weight = candidate;
+                    meeting_vertex = vertex;
+                }
+            }
+            for (size_t idx = stall_offsets[vertex]; idx < stall_offsets[vertex + 1]; ++idx) {
+                const auto& arc = stall_arcs[idx];
+                if (scratch.IsReached(arc.to) && scratch.weights[arc.to] + arc.weight < weight) {
+                    return;
+                }
+            }
+            for (size_t idx = offsets[vertex]; idx < offsets[vertex + 1]; ++idx) {
+                const auto& arc = arcs[idx];
+                scratch.Relax(arc.to, weight + arc.weight, arc.edge_id);
+            }
+        };
+
+        while (!forward.heap.empty() || !backward.heap.empty()) {
+            if (!forward.heap.empty()) {
+                step(forward, backward, up_offsets_, up_arcs_, down_offsets_, down_arcs_);
+            }
+            if (!backward.heap.empty()) {
+                step(backward, forward, down_offsets_, down_arcs_, up_offsets_, up_arcs_);
+            }
+        }
+
+        if (!best_weight) {
+            return std::nullopt;
+        }
+
+        ch_edges.clear();
+        for (EdgeId edge_id = forward.prev_edges[meeting_vertex]; edge_id != NO_EDGE;
+            edge_id = forward.prev_edges[edges_[edge_id].from]) {
+            ch_edges.push_back(edge_id);
+        }
+        std::reverse(ch_edges.begin(), ch_edges.end());
+        for (EdgeId edge_id = backward.prev_edges[meeting_vertex]; edge_id != NO_EDGE;
+            edge_id = backward.prev_edges[edges_[edge_id].to]) {
+            ch_edges.push_back(edge_id);
+        }
+        for (const EdgeId edge_id : ch_edges) {
+            UnpackEdge(edge_id, unpack_stack, edges);
+        }
+        return best_weight;
+    }
+
+    template <typename Weight>
+    void ContractionHierarchy<Weight>::UnpackEdge(EdgeId edge_id, std::vector<EdgeId>& stack,
+        std::vector<EdgeId>& edges) const {
+        stack.assign(1, edge_id);
+        while (!stack.empty()) {
+            const EdgeId current = stack.back();
+            stack.pop_back();
+            const auto& edge = edges_[current];
+            if (edge.first == NO_EDGE) {
+                edges.push_back(current);
+            } else {
+                stack.push_back(edge.second);
+                stack.push_back(edge.first);
+            }
+        }
+    }
+
+}
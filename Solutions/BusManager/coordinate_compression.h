@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Stops that follow each other on some bus route, one sorted list per stop id.
+using StopAdjacency = vector<vector<uint32_t>>;
+
+inline void AddNeighbours(StopAdjacency& adjacency, uint32_t lhs, uint32_t rhs) {
+    adjacency[lhs].push_back(rhs);
+    adjacency[rhs].push_back(lhs);
+}
+
+inline void SortNeighbours(StopAdjacency& adjacency) {
+    for (auto& neighbours : adjacency) {
+        sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(unique(neighbours.begin(), neighbours.end()), neighbours.end());
+    }
+}
+
+// Stops come sorted along one axis. Each one gets the smallest index that is greater
+// than the indices of its neighbours earlier in the order, so neighbouring stops never
+// share a coordinate while unrelated stops squeeze together. Only real neighbours are
+// looked at, which makes it O(N + E) on top of the sort.
+inline vector<int> CompressCoordinates(const vector<uint32_t>& stop_order, const StopAdjacency& adjacency) {
+    const int NOT_YET = -1;
+    vector<int> position_by_stop(adjacency.size(), NOT_YET);
+    vector<int> id_after_compress(stop_order.size(), 0);
+    for (size_t i = 0; i < stop_order.size(); ++i) {
+        int max_neighbour_id = -1;
+        for (const uint32_t neighbour : adjacency[stop_order[i]]) {
+            const int position = position_by_stop[neighbour];
+            if (position != NOT_YET) {
+                max_neighbour_id = max(max_neighbour_id, id_after_compress[position]);
+            }
+        }
+        id_after_compress[i] = max_neighbour_id + 1;
+        position_by_stop[stop_order[i]] = static_cast<int>(i);
+    }
+    return id_after_compress;
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include "serialization.h"
+
 #include <cstdlib>
 #include <deque>
+#include <iterator>
+#include <ostream>
 #include <vector>
 
 template <typename It>
@@ -12,6 +16,7 @@ public:
     Range(It begin, It end) : begin_(begin), end_(end) {}
     It begin() const { return begin_; }
     It end() const { return end_; }
+    size_t size() const { return std::distance(begin_, end_); }
 
 private:
     It begin_;
@@ -34,37 +39,188 @@ namespace Graph {
     class DirectedWeightedGraph {
     private:
         using IncidenceList = std::vector<EdgeId>;
-        using IncidentEdgesRange = Range<typename IncidenceList::const_iterator>;
+        using IncidentEdgesRange = Range<const EdgeId*>;
 
     public:
         DirectedWeightedGraph(size_t vertex_count);
+        explicit DirectedWeightedGraph(Serialization::Reader& in);
         EdgeId AddEdge(const Edge<Weight>& edge);
+        // Keeps the graph frozen if it is, updating the weight in the CSR arrays too.
+        void SetEdgeWeight(EdgeId edge_id, Weight weight);
+
+        // Packs incidence lists into compressed sparse row form: one offsets array and
+        // contiguous edge id / target / weight arrays ordered by source vertex. Edge ids
+        // do not change. Adding an edge to a frozen graph unpacks it again.
+        void Freeze();
+        bool IsFrozen() const;
 
         size_t GetVertexCount() const;
         size_t GetEdgeCount() const;
         const Edge<Weight>& GetEdge(EdgeId edge_id) const;
         IncidentEdgesRange GetIncidentEdges(VertexId vertex) const;
 
+        // Calls func(edge_id, to, weight) for every edge leaving vertex; reads only the
+        // sequential CSR arrays when the graph is frozen.
+        template <typename Func>
+        void ForEachIncidentEdge(VertexId vertex, Func func) const;
+
+        // Writes the graph as is, frozen arrays included, so loading it needs no Freeze().
+        void Serialize(std::ostream& out) const;
+
     private:
+        void Thaw();
+
+        size_t vertex_count_;
         std::vector<Edge<Weight>> edges_;
         std::vector<IncidenceList> incidence_lists_;
+
+        bool frozen_ = false;
+        std::vector<size_t> offsets_;
+        std::vector<EdgeId> incident_edge_ids_;
+        std::vector<VertexId> incident_targets_;
+        std::vector<Weight> incident_weights_;
     };
 
 
     template <typename Weight>
-    DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
+    DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count)
+        : vertex_count_(vertex_count)
+        , incidence_lists_(vertex_count)
+    {}
+
+    template <typename Weight>
+    DirectedWeightedGraph<Weight>::DirectedWeightedGraph(Serialization::Reader& in) {
+        using Serialization::Deserialize;
+        Deserialize(in, vertex_count_);
+        Deserialize(in, edges_);
+        Deserialize(in, incidence_lists_);
+        Deserialize(in, frozen_);
+        Deserialize(in, offsets_);
+        Deserialize(in, incident_edge_ids_);
+        Deserialize(in, incident_targets_);
+        Deserialize(in, incident_weights_);
+
+        // Searches rely on weights that are not negative and on every vertex listing
+        // exactly its own edges; otherwise a route traced back could go round a cycle.
+        using Serialization::Check;
+        for (const auto& edge : edges_) {
+            Check(edge.from < vertex_count_ && edge.to < vertex_count_, "Serialized graph has an edge to a missing vertex");
+            Check(edge.weight >= 0, "Serialized graph has a negative edge weight");
+        }
+        Check(incidence_lists_.size() == vertex_count_, "Serialized graph has a bad vertex count");
+        for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+            for (const EdgeId edge_id : incidence_lists_[vertex]) {
+                Check(edge_id < edges_.size() && edges_[edge_id].from == vertex, "Serialized graph has a bad incident edge");
+            }
+        }
+        if (!frozen_) {
+            Check(offsets_.empty() && incident_edge_ids_.empty() && incident_targets_.empty() && incident_weights_.empty(),
+                "Serialized graph has packed edges but is not frozen");
+            return;
+        }
+        Check(offsets_.size() == vertex_count_ + 1 && offsets_.front() == 0
+            && offsets_.back() == incident_edge_ids_.size()
+            && incident_targets_.size() == incident_edge_ids_.size()
+            && incident_weights_.size() == incident_edge_ids_.size(),
+            "Serialized graph has bad packed edge arrays");
+        for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+            Check(offsets_[vertex] <= offsets_[vertex + 1], "Serialized graph has decreasing edge offsets");
+            for (size_t idx = offsets_[vertex]; idx < offsets_[vertex + 1]; ++idx) {
+                const EdgeId edge_id = incident_edge_ids_[idx];
+                Check(edge_id < edges_.size() && edges_[edge_id].from == vertex
+                    && edges_[edge_id].to == incident_targets_[idx] && edges_[edge_id].weight == incident_weights_[idx],
+                    "Serialized graph has a bad incident edge");
+            }
+        }
+    }
+
+    template <typename Weight>
+    void DirectedWeightedGraph<Weight>::Serialize(std::ostream& out) const {
+        using Serialization::Serialize;
+        Serialize(vertex_count_, out);
+        Serialize(edges_, out);
+        Serialize(incidence_lists_, out);
+        Serialize(frozen_, out);
+        Serialize(offsets_, out);
+        Serialize(incident_edge_ids_, out);
+        Serialize(incident_targets_, out);
+        Serialize(incident_weights_, out);
+    }
 
     template <typename Weight>
     EdgeId DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
+        if (frozen_) {
+            Thaw();
+        }
         edges_.push_back(edge);
         const EdgeId id = edges_.size() - 1;
         incidence_lists_[edge.from].push_back(id);
         return id;
     }
 
+    template <typename Weight>
+    void DirectedWeightedGraph<Weight>::SetEdgeWeight(EdgeId edge_id, Weight weight) {
+        auto& edge = edges_[edge_id];
+        edge.weight = weight;
+        if (!frozen_) {
+            return;
+        }
+        for (size_t idx = offsets_[edge.from]; idx < offsets_[edge.from + 1]; ++idx) {
+            if (incident_edge_ids_[idx] == edge_id) {
+                incident_weights_[idx] = weight;
+                return;
+            }
+        }
+    }
+
+    template <typename Weight>
+    void DirectedWeightedGraph<Weight>::Freeze() {
+        if (frozen_) {
+            return;
+        }
+        offsets_.assign(vertex_count_ + 1, 0);
+        for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+            offsets_[vertex + 1] = offsets_[vertex] + incidence_lists_[vertex].size();
+        }
+
+        incident_edge_ids_.clear();
+        incident_edge_ids_.reserve(edges_.size());
+        for (auto& incidence_list : incidence_lists_) {
+            incident_edge_ids_.insert(incident_edge_ids_.end(), incidence_list.begin(), incidence_list.end());
+            IncidenceList().swap(incidence_list);
+        }
+        incident_targets_.resize(incident_edge_ids_.size());
+        incident_weights_.resize(incident_edge_ids_.size());
+        for (size_t idx = 0; idx < incident_edge_ids_.size(); ++idx) {
+            const auto& edge = edges_[incident_edge_ids_[idx]];
+            incident_targets_[idx] = edge.to;
+            incident_weights_[idx] = edge.weight;
+        }
+        frozen_ = true;
+    }
+
+    template <typename Weight>
+    void DirectedWeightedGraph<Weight>::Thaw() {
+        for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+            incidence_lists_[vertex].assign(
+                incident_edge_ids_.begin() + offsets_[vertex],
+                incident_edge_ids_.begin() + offsets_[vertex + 1]);
+        }
+        offsets_.clear();
+        incident_edge_ids_.clear();
+        incident_targets_.clear();
+        incident_weights_.clear();
+        frozen_ = false;
+    }
+
+    template <typename Weight>
+    bool DirectedWeightedGraph<Weight>::IsFrozen() const {
+        return frozen_;
+    }
+
     template <typename Weight>
     size_t DirectedWeightedGraph<Weight>::GetVertexCount() const {
-        return incidence_lists_.size();
+        return vertex_count_;
     }
 
     template <typename Weight>
@@ -80,7 +236,26 @@ namespace Graph {
     template <typename Weight>
     typename DirectedWeightedGraph<Weight>::IncidentEdgesRange
         DirectedWeightedGraph<Weight>::GetIncidentEdges(VertexId vertex) const {
+        if (frozen_) {
+            const EdgeId* data = incident_edge_ids_.data();
+            return { data + offsets_[vertex], data + offsets_[vertex + 1] };
+        }
         const auto& edges = incidence_lists_[vertex];
-        return { std::begin(edges), std::end(edges) };
+        return { edges.data(), edges.data() + edges.size() };
+    }
+
+    template <typename Weight>
+    template <typename Func>
+    void DirectedWeightedGraph<Weight>::ForEachIncidentEdge(VertexId vertex, Func func) const {
+        if (frozen_) {
+            for (size_t idx = offsets_[vertex]; idx < offsets_[vertex + 1]; ++idx) {
+                func(incident_edge_ids_[idx], incident_targets_[idx], incident_weights_[idx]);
+            }
+            return;
+        }
+        for (const EdgeId edge_id : incidence_lists_[vertex]) {
+            const auto& edge = edges_[edge_id];
+            func(edge_id, edge.to, edge.weight);
+        }
     }
 }
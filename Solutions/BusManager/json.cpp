@@ -1,7 +1,11 @@
 #include "json.h"
+#include <algorithm>
 #include <cassert>
-#include <iomanip>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
 
 using namespace std;
 
@@ -13,147 +17,443 @@ namespace Json {
         return root;
     }
         
-    Node LoadNode(istream& input);
-
-    Node LoadArray(istream& input) {
-        vector<Node> result;
+    Document Load(istream& input) {
+        const string text = ReadAll(input);
+        Reader reader(text);
+        return Document{ reader.ReadNode() };
+    }
 
-        for (char c; input >> c && c != ']'; ) {
-            if (c != ',') {
-                input.putback(c);
-            }
-            result.push_back(LoadNode(input));
+    string ReadAll(istream& input) {
+        string text;
+        char buffer[1 << 16];
+        while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0) {
+            text.append(buffer, static_cast<size_t>(input.gcount()));
         }
+        return text;
+    }
 
-        return Node(move(result));
+    namespace {
+        const double EXACT_POWERS_OF_TEN[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        const uint64_t MAX_EXACT_MANTISSA = uint64_t(1) << 53;
+
+        bool IsDigit(char c) {
+            return c >= '0' && c <= '9';
+        }
     }
 
-    Node LoadDouble(istream& input) {
-        double result = 0;
-        if (input.peek() == 't') {
-            string value;
-            for (int i = 0; i < 4; ++i) {
-                value += static_cast<char>(input.get());
+    // Numbers in the inputs are short decimals: their digits make an integer below
+    // 2^53 and the divisor is an exact power of ten, so one division rounds correctly
+    // (Clinger's fast path). Everything else goes through from_chars.
+    size_t ParseNumber(string_view text, double& value) {
+        const char* const begin = text.data();
+        const char* const end = begin + text.size();
+        const bool negative = begin != end && *begin == '-';
+        const char* const digits = begin + (negative ? 1 : 0);
+
+        const char* pos = digits;
+        uint64_t mantissa = 0;
+        size_t digit_count = 0;
+        while (pos != end && IsDigit(*pos) && digit_count < 19) {
+            mantissa = mantissa * 10 + static_cast<uint64_t>(*pos++ - '0');
+            ++digit_count;
+        }
+        if (pos == digits) {
+            return 0;
+        }
+        size_t fraction_count = 0;
+        if (pos != end && *pos == '.' && digit_count < 19) {
+            ++pos;
+            while (pos != end && IsDigit(*pos) && digit_count < 19) {
+                mantissa = mantissa * 10 + static_cast<uint64_t>(*pos++ - '0');
+                ++digit_count;
+                ++fraction_count;
             }
-            assert(value == "true");
-            return Node(1.0);
         }
 
-        if (input.peek() == 'f') {
-            string value;
-            for (int i = 0; i < 5; ++i) {
-                value += static_cast<char>(input.get());
+        const bool complete = pos == end || (!IsDigit(*pos) && *pos != '.' && *pos != 'e' && *pos != 'E');
+        if (complete && fraction_count == 0) {
+            value = static_cast<double>(mantissa);
+        } else if (complete && fraction_count > 0 && mantissa <= MAX_EXACT_MANTISSA) {
+            value = static_cast<double>(mantissa) / EXACT_POWERS_OF_TEN[fraction_count];
+        } else {
+            const auto [number_end, error] = from_chars(begin, end, value);
+            if (error != errc()) {
+                return 0;
             }
-            assert(value == "false");
-            return Node(0.0);
+            return number_end - begin;
+        }
+        if (negative) {
+            value = -value;
         }
+        return pos - begin;
+    }
+
+    Reader::Reader(string_view text, EScanKernel kernel)
+        : text_(text)
+        , index_(BuildStructuralIndex(text, kernel))
+    {
+    }
+
+    char Reader::Peek() const {
+        if (token_ == index_.size()) {
+            throw ParsingError("Unexpected end of JSON");
+        }
+        return text_[index_[token_]];
+    }
+
+    bool Reader::AtEnd() const {
+        return token_ == index_.size();
+    }
+
+    void Reader::Expect(char c) {
+        if (Peek() != c) {
+            throw ParsingError("Expected '"s + c + "' at offset " + to_string(index_[token_]));
+        }
+        ++token_;
+    }
+
+    void Reader::BeginObject() {
+        Expect('{');
+    }
 
-        double sign = 1.0;
-        if (input.peek() == '-') {
-            input.get();
-            sign = -1.0;
+    bool Reader::NextKey(string_view& key) {
+        const char c = Peek();
+        if (c == '}') {
+            ++token_;
+            return false;
+        }
+        if (c == ',') {
+            ++token_;
         }
+        key = ReadString();
+        Expect(':');
+        return true;
+    }
 
-        while (isdigit(input.peek())) {
-            result *= 10;
-            result += static_cast<double>(input.get() - static_cast<long long>('0'));
+    void Reader::BeginArray() {
+        Expect('[');
+    }
+
+    bool Reader::NextItem() {
+        const char c = Peek();
+        if (c == ']') {
+            ++token_;
+            return false;
+        }
+        if (c == ',') {
+            ++token_;
         }
+        return true;
+    }
 
-        if (input.peek() == '.') {
-            double coef = 1.0;
-            input.get();
-			while (isdigit(input.peek())) {
-                coef /= 10;
-                result += coef * static_cast<double>(input.get() - static_cast<long long>('0'));
-			}
+    // Nothing inside a string is indexed, so the closing quote is the next token.
+    string_view Reader::ReadString() {
+        Expect('"');
+        const size_t begin = index_[token_ - 1] + 1;
+        if (token_ == index_.size() || text_[index_[token_]] != '"') {
+            throw ParsingError("Unterminated string at offset " + to_string(begin));
         }
+        return text_.substr(begin, index_[token_++] - begin);
+    }
 
-        result *= sign;
+    double Reader::ReadDouble() {
+        const char first = Peek();
+        const size_t pos = index_[token_++];
+        if (first == 't' || first == 'f') {
+            const string_view literal = first == 't' ? "true" : "false";
+            if (text_.substr(pos, literal.size()) != literal) {
+                throw ParsingError("Bad literal at offset " + to_string(pos));
+            }
+            return first == 't' ? 1.0 : 0.0;
+        }
 
-        return Node(result);
+        double result;
+        if (ParseNumber(text_.substr(pos), result) == 0) {
+            throw ParsingError("Bad number at offset " + to_string(pos));
+        }
+        return result;
     }
 
-    Node LoadString(istream& input) {
-        string line;
-        getline(input, line, '"');
-        return Node(move(line));
+    Node Reader::ReadArray() {
+        vector<Node> result;
+        BeginArray();
+        while (NextItem()) {
+            result.push_back(ReadNode());
+        }
+        return Node(move(result));
     }
 
-    Node LoadDict(istream& input) {
+    Node Reader::ReadObject() {
         map<string, Node> result;
+        BeginObject();
+        string_view key;
+        while (NextKey(key)) {
+            result.emplace(string(key), ReadNode());
+        }
+        return Node(move(result));
+    }
+
+    Node Reader::ReadNode() {
+        switch (Peek()) {
+            case '[':
+                return ReadArray();
+            case '{':
+                return ReadObject();
+            case '"':
+                return Node(string(ReadString()));
+            default:
+                return Node(ReadDouble());
+        }
+    }
+
+    const Element& Reader::ReadElement(Arena& arena) {
+        Element* element = arena.Allocate<Element>(1);
+        *element = BuildElement(arena);
+        return *element;
+    }
 
-        for (char c; input >> c && c != '}'; ) {
-            if (c == ',') {
-                input >> c;
+    Element Reader::BuildElement(Arena& arena) {
+        switch (Peek()) {
+            case '[': {
+                const size_t mark = item_stack_.size();
+                BeginArray();
+                while (NextItem()) {
+                    const Element item = BuildElement(arena);
+                    item_stack_.push_back(item);
+                }
+                const size_t count = item_stack_.size() - mark;
+                Element* items = arena.Allocate<Element>(count);
+                copy(item_stack_.begin() + mark, item_stack_.end(), items);
+                item_stack_.erase(item_stack_.begin() + mark, item_stack_.end());
+                return Element::MakeArray(items, count);
             }
+            case '{': {
+                const size_t mark = member_stack_.size();
+                BeginObject();
+                string_view key;
+                while (NextKey(key)) {
+                    const Element value = BuildElement(arena);
+                    member_stack_.push_back({ key, value });
+                }
+                // Sorted and deduplicated like a std::map filled with emplace: the
+                // first occurrence of a key wins.
+                const auto begin = member_stack_.begin() + mark;
+                const auto by_key = [](const ElementMember& lhs, const ElementMember& rhs) {
+                    return lhs.first < rhs.first;
+                };
+                if (!is_sorted(begin, member_stack_.end(), by_key)) {
+                    stable_sort(begin, member_stack_.end(), by_key);
+                }
+                const auto end = unique(begin, member_stack_.end(),
+                    [](const ElementMember& lhs, const ElementMember& rhs) { return lhs.first == rhs.first; });
+                const size_t count = end - begin;
+                ElementMember* members = arena.Allocate<ElementMember>(count);
+                copy(begin, end, members);
+                member_stack_.erase(begin, member_stack_.end());
+                return Element::MakeObject(members, count);
+            }
+            case '"':
+                return Element::MakeString(ReadString());
+            default:
+                return Element::MakeNumber(ReadDouble());
+        }
+    }
 
-            string key = LoadString(input).AsString();
-            input >> c;
-            result.emplace(move(key), LoadNode(input));
+    void Reader::SkipValue() {
+        switch (Peek()) {
+            case '[':
+                BeginArray();
+                while (NextItem()) {
+                    SkipValue();
+                }
+                break;
+            case '{': {
+                BeginObject();
+                string_view key;
+                while (NextKey(key)) {
+                    SkipValue();
+                }
+                break;
+            }
+            case '"':
+                ReadString();
+                break;
+            default:
+                ReadDouble();
+                break;
         }
+    }
 
-        return Node(move(result));
+    void Node::Print(ostream& os) const {
+        Writer writer(os);
+        writer.Value(*this);
+    }
+
+    Writer::Writer(ostream& output, size_t buffer_size, ELayout layout)
+        : output_(output)
+        , buffer_(buffer_size)
+        , is_multiline_(layout == ELayout::MULTILINE)
+    {
     }
 
-    Node LoadNode(istream& input) {
-        char c;
-        input >> c;
+    Writer::~Writer() {
+        Flush();
+    }
 
-        if (c == '[') {
-            return LoadArray(input);
+    void Writer::Flush() {
+        output_.write(buffer_.data(), size_);
+        size_ = 0;
+    }
+
+    void Writer::Append(string_view data) {
+        if (data.size() > buffer_.size() - size_) {
+            Flush();
+            if (data.size() > buffer_.size()) {
+                output_.write(data.data(), data.size());
+                return;
+            }
+        }
+        copy(data.begin(), data.end(), buffer_.data() + size_);
+        size_ += data.size();
+    }
+
+    void Writer::Append(char c) {
+        if (size_ == buffer_.size()) {
+            Flush();
         }
-        else if (c == '{') {
-            return LoadDict(input);
+        buffer_[size_++] = c;
+    }
+
+    // Elements go on lines of their own: a comma ends the previous one and the
+    // closing bracket gets a line break only when something came before it.
+    void Writer::BeforeValue() {
+        if (after_key_) {
+            after_key_ = false;
+            return;
         }
-        else if (c == '"') {
-            return LoadString(input);
+        if (!not_empty_.empty()) {
+            if (not_empty_.back()) {
+                Append(is_multiline_ ? ",\n" : ",");
+            }
+            not_empty_.back() = true;
+        }
+    }
+
+    void Writer::BeginArray() {
+        BeforeValue();
+        Append(is_multiline_ ? "[\n" : "[");
+        not_empty_.push_back(false);
+    }
+
+    void Writer::EndArray() {
+        if (not_empty_.back() && is_multiline_) {
+            Append('\n');
+        }
+        not_empty_.pop_back();
+        Append(']');
+    }
+
+    void Writer::BeginObject() {
+        BeforeValue();
+        Append(is_multiline_ ? "{\n" : "{");
+        not_empty_.push_back(false);
+    }
+
+    void Writer::EndObject() {
+        if (not_empty_.back() && is_multiline_) {
+            Append('\n');
+        }
+        not_empty_.pop_back();
+        Append('}');
+    }
+
+    void Writer::Key(string_view key) {
+        BeforeValue();
+        Append('"');
+        Append(key);
+        Append("\": ");
+        after_key_ = true;
+    }
+
+    void Writer::Number(double value) {
+        BeforeValue();
+        char buffer[64];
+        to_chars_result result;
+        if (abs(static_cast<int>(value) - value) < 1e-8) {
+            result = to_chars(buffer, buffer + sizeof(buffer), static_cast<int>(round(value)));
         }
         else {
-            input.putback(c);
-            return LoadDouble(input);
+            result = to_chars(buffer, buffer + sizeof(buffer), value, chars_format::fixed, 6);
         }
+        Append(string_view(buffer, result.ptr - buffer));
     }
 
-    Document Load(istream& input) {
-        return Document{ LoadNode(input) };
+    void Writer::String(string_view value) {
+        BeforeValue();
+        Append('"');
+        Append(value);
+        Append('"');
     }
 
-    void Node::Print(ostream& os) const {
-        if (holds_alternative<double>(*this)) {
-            double value = get<double>(*this);
-            if (abs(static_cast<int>(value) - value) < 1e-8) {
-                os << static_cast<int>(round(value));
+    void Writer::EscapedString(initializer_list<string_view> parts) {
+        BeforeValue();
+        Append('"');
+        for (const string_view part : parts) {
+            AppendEscaped(part);
+        }
+        Append('"');
+    }
+
+    // Escaping at most doubles a slice, so a slice that fits in half of the free space
+    // is written straight into the buffer without further checks.
+    void Writer::AppendEscaped(string_view data) {
+        while (!data.empty()) {
+            if (buffer_.size() - size_ < 2) {
+                Flush();
             }
-            else {
-                os << fixed << setprecision(6) << get<double>(*this);
+            const size_t slice_size = min(data.size(), (buffer_.size() - size_) / 2);
+            string_view slice = data.substr(0, slice_size);
+            char* out = buffer_.data() + size_;
+            while (true) {
+                const size_t special = FindQuoteOrBackslash(slice);
+                memcpy(out, slice.data(), special);
+                out += special;
+                if (special == slice.size()) {
+                    break;
+                }
+                *out++ = '\\';
+                *out++ = slice[special];
+                slice.remove_prefix(special + 1);
             }
+            size_ = out - buffer_.data();
+            data.remove_prefix(slice_size);
+        }
+    }
+
+    void Writer::Value(const Node& node) {
+        if (node.IsDouble()) {
+            Number(node.AsDouble());
         }
-        else if (holds_alternative<string>(*this)) {
-            os << "\"" << get<string>(*this) << "\"";
+        else if (node.IsString()) {
+            String(node.AsString());
         }
-        else if (holds_alternative<vector<Node>>(*this)) {
-            os << "[\n";
-            for (size_t i = 0; i < (*this).AsArray().size(); ++i) {
-                (*this).AsArray()[i].Print(os);
-                if (i + 1 < (*this).AsArray().size()) {
-                    os << ",";
-                }
-                os << "\n";
+        else if (node.IsArray()) {
+            BeginArray();
+            for (const auto& item : node.AsArray()) {
+                Value(item);
             }
-            os << "]";
-        }
-        else if (holds_alternative<map<string, Node>>(*this)) {
-            os << "{\n";
-            const auto& cur_map = (*this).AsMap();
-            for (auto it = cur_map.cbegin(); it != cur_map.cend(); ++it) {
-                os << "\"" << it->first << "\": ";
-                (it->second).Print(os);
-                if (next(it) != cur_map.cend()) {
-                    os << ",";
-                }
-                os << "\n";
+            EndArray();
+        }
+        else {
+            BeginObject();
+            for (const auto& [key, value] : node.AsMap()) {
+                Key(key);
+                Value(value);
             }
-            os << "}";
+            EndObject();
         }
     }
 }
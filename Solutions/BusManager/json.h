@@ -1,9 +1,16 @@
 #pragma once
 
+#include "json_element.h"
+#include "json_scan.h"
+
+#include <initializer_list>
 #include <istream>
 #include <map>
+#include <ostream>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -39,6 +46,10 @@ namespace Json {
         bool IsArray() const {
             return std::holds_alternative<std::vector<Node>>(*this);
         }
+
+        bool IsDouble() const {
+            return std::holds_alternative<double>(*this);
+        }
         
         void Print(std::ostream& os) const;
     };
@@ -54,4 +65,116 @@ namespace Json {
     };
 
     Document Load(std::istream& input);
+
+    class ParsingError : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    // Parses the number at the start of text into value and returns its length, or 0
+    // when text does not start with a number. Results are correctly rounded; integers
+    // short enough for uint64_t skip the general conversion.
+    size_t ParseNumber(std::string_view text, double& value);
+
+    // Reads the whole stream in large blocks.
+    std::string ReadAll(std::istream& input);
+
+    // Pull parser over a JSON text kept in memory. Values are consumed in document
+    // order and only ReadNode() builds a Node, so a big array can be handled one
+    // element at a time without materializing the rest of the document.
+    //
+    // Parsing has two stages: BuildStructuralIndex() finds all token starts up front,
+    // then the reader steps from token to token and never looks at whitespace or
+    // string contents byte by byte.
+    //
+    // Strings are taken as is, up to the closing quote, without decoding escapes;
+    // true and false read as 1 and 0.
+    class Reader {
+    public:
+        explicit Reader(std::string_view text, EScanKernel kernel = GetBestScanKernel());
+
+        // Enters an object; then NextKey() moves to each member's value in turn and
+        // returns false, having consumed the closing brace, when none are left.
+        void BeginObject();
+        bool NextKey(std::string_view& key);
+
+        // Enters an array; then NextItem() moves to each element in turn and returns
+        // false, having consumed the closing bracket, when none are left.
+        void BeginArray();
+        bool NextItem();
+
+        Node ReadNode();
+        // Builds the value in the arena; its strings point into the reader's text.
+        const Element& ReadElement(Arena& arena);
+        std::string_view ReadString();
+        double ReadDouble();
+        void SkipValue();
+        // True once every token of the text has been consumed.
+        bool AtEnd() const;
+
+    private:
+        std::string_view text_;
+        std::vector<uint32_t> index_;
+        size_t token_ = 0;
+        // Children of the arrays and objects being built by ReadElement(), which
+        // are copied to the arena once their count is known.
+        std::vector<Element> item_stack_;
+        std::vector<ElementMember> member_stack_;
+
+        char Peek() const;
+        void Expect(char c);
+        Node ReadArray();
+        Node ReadObject();
+        Element BuildElement(Arena& arena);
+    };
+
+    // Streams JSON into a large buffer that goes to the output in big chunks, laid
+    // out exactly as Node::Print lays out the same value. The caller has to write
+    // object keys in sorted order, as a Node map would hold them. Strings are
+    // written as is.
+    class Writer {
+    public:
+        // SINGLE_LINE leaves out the line breaks, so a value can be one record of
+        // newline-delimited JSON.
+        enum class ELayout {
+            MULTILINE,
+            SINGLE_LINE
+        };
+
+        explicit Writer(std::ostream& output, size_t buffer_size = 1 << 20, ELayout layout = ELayout::MULTILINE);
+        ~Writer();
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        void BeginArray();
+        void EndArray();
+        void BeginObject();
+        void EndObject();
+        void Key(std::string_view key);
+
+        // Whole numbers go without a fractional part, others with 6 decimals.
+        void Number(double value);
+        void String(std::string_view value);
+        // One string made of the parts, with quotes and backslashes escaped on the
+        // way into the buffer.
+        void EscapedString(std::initializer_list<std::string_view> parts);
+        void Value(const Node& node);
+
+        void Flush();
+
+    private:
+        std::ostream& output_;
+        std::vector<char> buffer_;
+        size_t size_ = 0;
+        bool is_multiline_;
+        // Per open array or object: whether it already has an element.
+        std::vector<bool> not_empty_;
+        bool after_key_ = false;
+
+        void BeforeValue();
+        void Append(std::string_view data);
+        void Append(char c);
+        void AppendEscaped(std::string_view data);
+    };
 }
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Json {
+
+    // Bump allocator: hands out memory from large blocks and frees everything at
+    // once. Reset() keeps the blocks, so a loop that parses one value per iteration
+    // stops allocating after the first few.
+    class Arena {
+    public:
+        explicit Arena(size_t block_size = 64 * 1024)
+            : block_size_(block_size)
+        {}
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        // Nothing is ever destroyed, so only trivially destructible types are allowed.
+        template <typename T>
+        T* Allocate(size_t count) {
+            static_assert(std::is_trivially_destructible_v<T>);
+            return static_cast<T*>(AllocateBytes(count * sizeof(T), alignof(T)));
+        }
+
+        void Reset() {
+            block_idx_ = 0;
+            offset_ = 0;
+        }
+
+    private:
+        struct Block {
+            std::unique_ptr<char[]> data;
+            size_t size;
+        };
+
+        size_t block_size_;
+        std::vector<Block> blocks_;
+        size_t block_idx_ = 0;
+        size_t offset_ = 0;
+
+        void* AllocateBytes(size_t size, size_t alignment) {
+            while (true) {
+                if (block_idx_ < blocks_.size()) {
+                    const size_t begin = (offset_ + alignment - 1) & ~(alignment - 1);
+                    if (begin + size <= blocks_[block_idx_].size) {
+                        offset_ = begin + size;
+                        return blocks_[block_idx_].data.get() + begin;
+                    }
+                    if (block_idx_ + 1 < blocks_.size() && size <= blocks_[block_idx_ + 1].size) {
+                        ++block_idx_;
+                        offset_ = 0;
+                        continue;
+                    }
+                }
+                // new[] of char is aligned for any fundamental type.
+                const size_t new_size = std::max(block_size_, size);
+                const size_t new_idx = blocks_.empty() ? 0 : block_idx_ + 1;
+                blocks_.insert(blocks_.begin() + new_idx, Block{ std::make_unique<char[]>(new_size), new_size });
+                block_idx_ = new_idx;
+                offset_ = 0;
+            }
+        }
+    };
+
+    struct ElementMember;
+    class ElementArray;
+    class ElementObject;
+
+    // Read-only JSON value with everything in an Arena: arrays and objects are
+    // contiguous runs of elements and members, strings point into the parsed text.
+    // Elements are valid while both the arena and the text are.
+    class Element {
+    public:
+        enum class EType : uint8_t {
+            ARRAY,
+            OBJECT,
+            NUMBER,
+            STRING
+        };
+
+        static Element MakeNumber(double number) {
+            Element element(EType::NUMBER, 0);
+            element.number_ = number;
+            return element;
+        }
+
+        static Element MakeString(std::string_view str) {
+            Element element(EType::STRING, str.size());
+            element.chars_ = str.data();
+            return element;
+        }
+
+        static Element MakeArray(const Element* items, size_t size) {
+            Element element(EType::ARRAY, size);
+            element.items_ = items;
+            return element;
+        }
+
+        // Members have to be sorted by key without duplicates.
+        static Element MakeObject(const ElementMember* members, size_t size) {
+            Element element(EType::OBJECT, size);
+            element.members_ = members;
+            return element;
+        }
+
+        EType GetType() const {
+            return type_;
+        }
+
+        bool IsArray() const {
+            return type_ == EType::ARRAY;
+        }
+
+        bool IsString() const {
+            return type_ == EType::STRING;
+        }
+
+        ElementArray AsArray() const;
+        ElementObject AsMap() const;
+
+        double AsDouble() const {
+            Check(EType::NUMBER);
+            return number_;
+        }
+
+        std::string_view AsString() const {
+            Check(EType::STRING);
+            return { chars_, size_ };
+        }
+
+    private:
+        EType type_;
+        uint32_t size_;
+        union {
+            double number_;
+            const char* chars_;
+            const Element* items_;
+            const ElementMember* members_;
+        };
+
+        Element(EType type, size_t size)
+            : type_(type)
+            , size_(static_cast<uint32_t>(size))
+            , number_(0)
+        {}
+
+        void Check(EType type) const {
+            if (type_ != type) {
+                throw std::logic_error("Json::Element holds another type");
+            }
+        }
+    };
+
+    // first and second make a member look like a std::map entry.
+    struct ElementMember {
+        std::string_view first;
+        Element second;
+    };
+
+    class ElementArray {
+    public:
+        ElementArray(const Element* items, size_t size)
+            : items_(items)
+            , size_(size)
+        {}
+
+        const Element* begin() const { return items_; }
+        const Element* end() const { return items_ + size_; }
+        size_t size() const { return size_; }
+        const Element& operator[](size_t idx) const { return items_[idx]; }
+
+    private:
+        const Element* items_;
+        size_t size_;
+    };
+
+    // Members are sorted by key, so iteration goes in the same order as for a
+    // std::map and lookups are a short linear scan or a binary search.
+    class ElementObject {
+    public:
+        ElementObject(const ElementMember* members, size_t size)
+            : members_(members)
+            , size_(size)
+        {}
+
+        const ElementMember* begin() const { return members_; }
+        const ElementMember* end() const { return members_ + size_; }
+        size_t size() const { return size_; }
+
+        const Element* Find(std::string_view key) const {
+            const ElementMember* it = begin();
+            if (size_ <= LINEAR_SEARCH_MAX_SIZE) {
+                while (it != end() && it->first != key) {
+                    ++it;
+                }
+            } else {
+                it = std::lower_bound(begin(), end(), key,
+                    [](const ElementMember& member, std::string_view key) { return member.first < key; });
+                if (it != end() && it->first != key) {
+                    it = end();
+                }
+            }
+            return it != end() ? &it->second : nullptr;
+        }
+
+        const Element& at(std::string_view key) const {
+            const Element* element = Find(key);
+            if (!element) {
+                throw std::out_of_range("No member \"" + std::string(key) + "\" in JSON object");
+            }
+            return *element;
+        }
+
+        size_t count(std::string_view key) const {
+            return Find(key) ? 1 : 0;
+        }
+
+    private:
+        static constexpr size_t LINEAR_SEARCH_MAX_SIZE = 8;
+
+        const ElementMember* members_;
+        size_t size_;
+    };
+
+    inline ElementArray Element::AsArray() const {
+        Check(EType::ARRAY);
+        return { items_, size_ };
+    }
+
+    inline ElementObject Element::AsMap() const {
+        Check(EType::OBJECT);
+        return { members_, size_ };
+    }
+
+}
@@ -0,0 +1,288 @@
+#include "json_scan.h"
+#include "json.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JSON_SCAN_X86
+#include <immintrin.h>
+#endif
+
+#if defined(JSON_SCAN_X86) && defined(__GNUC__)
+#define JSON_SCAN_AVX2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+namespace Json {
+
+    namespace {
+
+        const size_t BLOCK_SIZE = 64;
+
+        // Bit i of each mask describes byte i of a block.
+        struct BlockMasks {
+            uint64_t quotes = 0;
+            uint64_t backslashes = 0;
+            uint64_t operators = 0;
+            uint64_t spaces = 0;
+        };
+
+        int CountTrailingZeros(uint64_t bits) {
+#ifdef _MSC_VER
+            unsigned long pos;
+            _BitScanForward64(&pos, bits);
+            return static_cast<int>(pos);
+#else
+            return __builtin_ctzll(bits);
+#endif
+        }
+
+        // Bit i is set when an odd number of quotes is at positions 0..i.
+        uint64_t PrefixXor(uint64_t bits) {
+            bits ^= bits << 1;
+            bits ^= bits << 2;
+            bits ^= bits << 4;
+            bits ^= bits << 8;
+            bits ^= bits << 16;
+            bits ^= bits << 32;
+            return bits;
+        }
+
+        // Characters preceded by an odd run of backslashes. Backslashes are rare, so
+        // walking them one by one costs nothing on real inputs.
+        uint64_t FindEscaped(uint64_t backslashes, bool& escape_carry) {
+            uint64_t escaped = escape_carry ? 1 : 0;
+            uint64_t escapes = backslashes & ~escaped;
+            escape_carry = false;
+            while (escapes) {
+                const int pos = CountTrailingZeros(escapes);
+                if (pos == 63) {
+                    escape_carry = true;
+                    break;
+                }
+                escaped |= uint64_t(1) << (pos + 1);
+                escapes &= ~(uint64_t(3) << pos);
+            }
+            return escaped;
+        }
+
+        BlockMasks ClassifyScalar(const char* block) {
+            BlockMasks masks;
+            for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+                const uint64_t bit = uint64_t(1) << i;
+                switch (block[i]) {
+                    case '"':
+                        masks.quotes |= bit;
+                        break;
+                    case '\\':
+                        masks.backslashes |= bit;
+                        break;
+                    case '{': case '}': case '[': case ']': case ':': case ',':
+                        masks.operators |= bit;
+                        break;
+                    case ' ': case '\t': case '\n': case '\r':
+                        masks.spaces |= bit;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return masks;
+        }
+
+#ifdef JSON_SCAN_X86
+        // '[' and ']' differ from '{' and '}' only in bit 0x20, so setting it folds
+        // each pair into one comparison.
+        BlockMasks ClassifySse2(const char* block) {
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i backslash = _mm_set1_epi8('\\');
+            const __m128i case_bit = _mm_set1_epi8(0x20);
+            const __m128i open_brace = _mm_set1_epi8('{');
+            const __m128i close_brace = _mm_set1_epi8('}');
+            const __m128i colon = _mm_set1_epi8(':');
+            const __m128i comma = _mm_set1_epi8(',');
+            const __m128i space = _mm_set1_epi8(' ');
+            const __m128i tab = _mm_set1_epi8('\t');
+            const __m128i line_feed = _mm_set1_epi8('\n');
+            const __m128i carriage_return = _mm_set1_epi8('\r');
+
+            BlockMasks masks;
+            for (size_t i = 0; i < BLOCK_SIZE / 16; ++i) {
+                const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i * 16));
+                const __m128i folded = _mm_or_si128(chunk, case_bit);
+                const __m128i operators = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(folded, open_brace), _mm_cmpeq_epi8(folded, close_brace)),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, colon), _mm_cmpeq_epi8(chunk, comma)));
+                const __m128i spaces = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, line_feed), _mm_cmpeq_epi8(chunk, carriage_return)));
+
+                const int shift = static_cast<int>(i * 16);
+                masks.quotes |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)))) << shift;
+                masks.backslashes |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash)))) << shift;
+                masks.operators |= uint64_t(uint16_t(_mm_movemask_epi8(operators))) << shift;
+                masks.spaces |= uint64_t(uint16_t(_mm_movemask_epi8(spaces))) << shift;
+            }
+            return masks;
+        }
+#endif
+
+#ifdef JSON_SCAN_AVX2
+        __attribute__((target("avx2")))
+        BlockMasks ClassifyAvx2(const char* block) {
+            const __m256i quote = _mm256_set1_epi8('"');
+            const __m256i backslash = _mm256_set1_epi8('\\');
+            const __m256i case_bit = _mm256_set1_epi8(0x20);
+            const __m256i open_brace = _mm256_set1_epi8('{');
+            const __m256i close_brace = _mm256_set1_epi8('}');
+            const __m256i colon = _mm256_set1_epi8(':');
+            const __m256i comma = _mm256_set1_epi8(',');
+            const __m256i space = _mm256_set1_epi8(' ');
+            const __m256i tab = _mm256_set1_epi8('\t');
+            const __m256i line_feed = _mm256_set1_epi8('\n');
+            const __m256i carriage_return = _mm256_set1_epi8('\r');
+
+            BlockMasks masks;
+            for (size_t i = 0; i < BLOCK_SIZE / 32; ++i) {
+                const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i * 32));
+                const __m256i folded = _mm256_or_si256(chunk, case_bit);
+                const __m256i operators = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(folded, open_brace), _mm256_cmpeq_epi8(folded, close_brace)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, colon), _mm256_cmpeq_epi8(chunk, comma)));
+                const __m256i spaces = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, line_feed), _mm256_cmpeq_epi8(chunk, carriage_return)));
+
+                const int shift = static_cast<int>(i * 32);
+                masks.quotes |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, quote)))) << shift;
+                masks.backslashes |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, backslash)))) << shift;
+                masks.operators |= uint64_t(uint32_t(_mm256_movemask_epi8(operators))) << shift;
+                masks.spaces |= uint64_t(uint32_t(_mm256_movemask_epi8(spaces))) << shift;
+            }
+            return masks;
+        }
+#endif
+
+        template <typename Classify>
+        void ScanBlocks(string_view text, Classify classify, vector<uint32_t>& index) {
+            uint64_t in_string_carry = 0;
+            uint64_t scalar_carry = 0;
+            bool escape_carry = false;
+
+            char padded[BLOCK_SIZE];
+            for (size_t offset = 0; offset < text.size(); offset += BLOCK_SIZE) {
+                const char* block = text.data() + offset;
+                if (text.size() - offset < BLOCK_SIZE) {
+                    // Spaces are neither tokens nor parts of them.
+                    memset(padded, ' ', BLOCK_SIZE);
+                    memcpy(padded, block, text.size() - offset);
+                    block = padded;
+                }
+
+                const BlockMasks masks = classify(block);
+                const uint64_t quotes = masks.quotes & ~FindEscaped(masks.backslashes, escape_carry);
+                // Opening quotes and string contents, but not closing quotes.
+                const uint64_t in_string = PrefixXor(quotes) ^ in_string_carry;
+                in_string_carry = in_string >> 63 ? ~uint64_t(0) : 0;
+
+                const uint64_t structural = (masks.operators & ~in_string) | quotes;
+                const uint64_t scalar = ~(masks.operators | masks.spaces | quotes | in_string);
+                const uint64_t scalar_starts = scalar & ~((scalar << 1) | scalar_carry);
+                scalar_carry = scalar >> 63;
+
+                for (uint64_t bits = structural | scalar_starts; bits; bits &= bits - 1) {
+                    index.push_back(static_cast<uint32_t>(offset + CountTrailingZeros(bits)));
+                }
+            }
+        }
+
+    }
+
+    bool IsScanKernelSupported(EScanKernel kernel) {
+        switch (kernel) {
+            case EScanKernel::SCALAR:
+                return true;
+#ifdef JSON_SCAN_X86
+            case EScanKernel::SSE2:
+                return true;
+#endif
+#ifdef JSON_SCAN_AVX2
+            case EScanKernel::AVX2:
+                return __builtin_cpu_supports("avx2");
+#endif
+            default:
+                return false;
+        }
+    }
+
+    EScanKernel GetBestScanKernel() {
+        static const EScanKernel best_kernel = [] {
+            for (const auto kernel : { EScanKernel::AVX2, EScanKernel::SSE2 }) {
+                if (IsScanKernelSupported(kernel)) {
+                    return kernel;
+                }
+            }
+            return EScanKernel::SCALAR;
+        }();
+        return best_kernel;
+    }
+
+    vector<uint32_t> BuildStructuralIndex(string_view text, EScanKernel kernel) {
+        if (text.size() > numeric_limits<uint32_t>::max()) {
+            throw ParsingError("JSON text is too large to index");
+        }
+        if (!IsScanKernelSupported(kernel)) {
+            kernel = EScanKernel::SCALAR;
+        }
+
+        vector<uint32_t> index;
+        // Typical BusManager input has a token per four bytes or so.
+        index.reserve(text.size() / 4 + 16);
+        switch (kernel) {
+#ifdef JSON_SCAN_AVX2
+            case EScanKernel::AVX2:
+                ScanBlocks(text, ClassifyAvx2, index);
+                break;
+#endif
+#ifdef JSON_SCAN_X86
+            case EScanKernel::SSE2:
+                ScanBlocks(text, ClassifySse2, index);
+                break;
+#endif
+            default:
+                ScanBlocks(text, ClassifyScalar, index);
+                break;
+        }
+        return index;
+    }
+
+    size_t FindQuoteOrBackslash(string_view text) {
+        size_t pos = 0;
+#ifdef JSON_SCAN_X86
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        for (; pos + 16 <= text.size(); pos += 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+            const int mask = _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+            if (mask != 0) {
+                return pos + CountTrailingZeros(static_cast<uint64_t>(mask));
+            }
+        }
+#endif
+        for (; pos < text.size(); ++pos) {
+            if (text[pos] == '"' || text[pos] == '\\') {
+                return pos;
+            }
+        }
+        return pos;
+    }
+
+}
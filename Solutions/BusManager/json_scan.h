@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace Json {
+
+    // How the first parsing stage classifies input bytes. All kernels give the same
+    // index; SSE2 and AVX2 compare 16 and 32 bytes per instruction.
+    enum class EScanKernel {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    bool IsScanKernelSupported(EScanKernel kernel);
+
+    // Widest kernel supported by the CPU the program runs on, detected once.
+    EScanKernel GetBestScanKernel();
+
+    // First parsing stage: offsets of every token start in text, in order. Those are
+    // braces, brackets, colons and commas outside strings, both quotes of every
+    // string and the first character of every number or literal. The text is
+    // processed in 64-byte blocks turned into bit masks, so string boundaries and
+    // escapes are resolved with a few word operations per block.
+    std::vector<uint32_t> BuildStructuralIndex(std::string_view text, EScanKernel kernel);
+
+    // Position of the first '"' or '\\' in text, or text.size() when there is none,
+    // checking 16 bytes at a time where SSE2 is available. Lets a writer escape long
+    // strings run by run instead of byte by byte.
+    size_t FindQuoteOrBackslash(std::string_view text);
+
+}
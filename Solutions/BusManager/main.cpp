@@ -3,6 +3,10 @@
 #include "manager.h"
 #include "utils.h"
 #include "requests.h"
+#include "thread_pool.h"
+#include "server.h"
+
+#include <csignal>
 
 using namespace std;
 
@@ -11,6 +15,14 @@ const unordered_map<string, Request::ERequestType> ModifyRequestTypeByString = {
     {"Bus", Request::ERequestType::ADD_BUS}
 };
 
+// Accepted by the server besides stat requests.
+const unordered_map<string, Request::ERequestType> UpdateRequestTypeByString = {
+    {"UpdateStop", Request::ERequestType::UPDATE_STOP},
+    {"UpdateBus", Request::ERequestType::UPDATE_BUS},
+    {"RemoveStop", Request::ERequestType::REMOVE_STOP},
+    {"RemoveBus", Request::ERequestType::REMOVE_BUS}
+};
+
 const unordered_map<string, Request::ERequestType> ReadRequestTypeByString = {
     {"Bus", Request::ERequestType::QUERY_BUS},
     {"Stop", Request::ERequestType::QUERY_STOP},
@@ -18,12 +30,31 @@ const unordered_map<string, Request::ERequestType> ReadRequestTypeByString = {
     {"Map", Request::ERequestType::QUERY_MAP}
 };
 
+const unordered_map<string, Graph::ERouterMode> RouterModeByString = {
+    {"all_pairs", Graph::ERouterMode::ALL_PAIRS},
+    {"dijkstra", Graph::ERouterMode::DIJKSTRA},
+    {"contraction_hierarchy", Graph::ERouterMode::CONTRACTION_HIERARCHY}
+};
+
+const unordered_map<string, EGraphModel> GraphModelByString = {
+    {"direct", EGraphModel::DIRECT},
+    {"layered", EGraphModel::LAYERED}
+};
+
 RequestHolder CreateRequestHolder(Request::ERequestType type) {
     switch (type) {
         case Request::ERequestType::ADD_BUS:
             return make_unique<AddBusRequest>();
         case Request::ERequestType::ADD_STOP:
             return make_unique<AddStopRequest>();
+        case Request::ERequestType::UPDATE_STOP:
+            return make_unique<UpdateStopRequest>();
+        case Request::ERequestType::UPDATE_BUS:
+            return make_unique<UpdateBusRequest>();
+        case Request::ERequestType::REMOVE_STOP:
+            return make_unique<RemoveStopRequest>();
+        case Request::ERequestType::REMOVE_BUS:
+            return make_unique<RemoveBusRequest>();
         case Request::ERequestType::QUERY_BUS:
             return make_unique<ReadBusInfoRequest>();
         case Request::ERequestType::QUERY_STOP:
@@ -37,10 +68,15 @@ RequestHolder CreateRequestHolder(Request::ERequestType type) {
     }
 }
 
-void ReadRequestsJson(vector<RequestHolder>& requests, const Node& node,
+// Requests are built one array element at a time in an arena that is reset for each
+// of them, so after the first few requests reading does not allocate for the DOM.
+void ReadRequestsJson(vector<RequestHolder>& requests, Json::Reader& reader, Json::Arena& arena,
     const unordered_map<string, Request::ERequestType>& RequestTypeByString) {
-    for (const auto& query_node : node.AsArray()) {
-        auto type = RequestTypeByString.at(query_node.AsMap().at("type").AsString());
+    reader.BeginArray();
+    while (reader.NextItem()) {
+        arena.Reset();
+        const auto& query_node = reader.ReadElement(arena);
+        auto type = RequestTypeByString.at(string(query_node.AsMap().at("type").AsString()));
         requests.push_back(CreateRequestHolder(type));
         requests.back()->ReadInfo(query_node);
     }
@@ -50,32 +86,84 @@ struct InputData {
     BusManagerSettings bus_manager_settings;
     RenderSettings render_settings;
     vector<RequestHolder> requests;
+    string serialization_file;
+    string socket_path;
 };
 
+// make_base input has no stat_requests and process_requests input has only them and
+// serialization_settings, so every section is optional.
 InputData ReadAllRequestsJson() {
-    auto document = Load(cin);
-    vector<RequestHolder> requests;
-
-    const auto& modify_requests = document.GetRoot().AsMap().at("base_requests");
-    ReadRequestsJson(requests, modify_requests, ModifyRequestTypeByString);
-
-    const auto& read_requests = document.GetRoot().AsMap().at("stat_requests");
-    ReadRequestsJson(requests, read_requests, ReadRequestTypeByString);
+    const string text = Json::ReadAll(cin);
+    Json::Reader reader(text);
+    Json::Arena arena;
+    InputData input;
 
-    const auto& settings_info = document.GetRoot().AsMap().at("routing_settings").AsMap();
-    auto settings = BusManagerSettings(
-        static_cast<int>(settings_info.at("bus_wait_time").AsDouble()),
-        static_cast<int>(settings_info.at("bus_velocity").AsDouble())
-    );
+    reader.BeginObject();
+    string_view key;
+    while (reader.NextKey(key)) {
+        if (key == "base_requests") {
+            ReadRequestsJson(input.requests, reader, arena, ModifyRequestTypeByString);
+        }
+        else if (key == "stat_requests") {
+            ReadRequestsJson(input.requests, reader, arena, ReadRequestTypeByString);
+        }
+        else if (key == "routing_settings") {
+            arena.Reset();
+            const auto settings_info = reader.ReadElement(arena).AsMap();
+            auto& settings = input.bus_manager_settings;
+            settings = BusManagerSettings(
+                static_cast<int>(settings_info.at("bus_wait_time").AsDouble()),
+                static_cast<int>(settings_info.at("bus_velocity").AsDouble())
+            );
+            if (settings_info.count("router")) {
+                settings.RouterMode = RouterModeByString.at(string(settings_info.at("router").AsString()));
+            }
+            if (settings_info.count("graph_model")) {
+                settings.GraphModel = GraphModelByString.at(string(settings_info.at("graph_model").AsString()));
+            }
+        }
+        else if (key == "render_settings") {
+            arena.Reset();
+            input.render_settings = RenderSettings(reader.ReadElement(arena).AsMap());
+        }
+        else if (key == "serialization_settings") {
+            arena.Reset();
+            input.serialization_file = reader.ReadElement(arena).AsMap().at("file").AsString();
+        }
+        else if (key == "server_settings") {
+            arena.Reset();
+            input.socket_path = reader.ReadElement(arena).AsMap().at("socket").AsString();
+        }
+        else {
+            reader.SkipValue();
+        }
+    }
 
-    auto render_settings = RenderSettings(document.GetRoot().AsMap().at("render_settings").AsMap());
+    return input;
+}
 
-    return { settings, render_settings, move(requests) };
+unique_ptr<Response> ProcessReadRequest(const Request& request_holder, const BusManager& manager) {
+    if (request_holder.Type == Request::ERequestType::QUERY_BUS) {
+        const auto& request = static_cast<const ReadBusInfoRequest&>(request_holder);
+        return make_unique<BusInfoResponse>(request.Process(manager));
+    }
+    else if (request_holder.Type == Request::ERequestType::QUERY_STOP) {
+        const auto& request = static_cast<const ReadStopInfoRequest&>(request_holder);
+        return make_unique<StopInfoResponse>(request.Process(manager));
+    }
+    else if (request_holder.Type == Request::ERequestType::QUERY_ROUTE) {
+        const auto& request = static_cast<const ReadRouteInfoRequest&>(request_holder);
+        return make_unique<RouteInfoResponse>(request.Process(manager));
+    }
+    else if (request_holder.Type == Request::ERequestType::QUERY_MAP) {
+        const auto& request = static_cast<const ReadMapInfoRequest&>(request_holder);
+        return make_unique<MapInfoResponse>(request.Process(manager));
+    }
+    return nullptr;
 }
 
-vector<unique_ptr<Response>> GetResponses(const InputData& input) {
+BusManager BuildManager(const InputData& input) {
     BusManager manager(input.bus_manager_settings, input.render_settings);
-    vector<unique_ptr<Response>> responses;
     
     for (auto& request_holder : input.requests) {
         if (request_holder->Type == Request::ERequestType::ADD_STOP) {
@@ -92,90 +180,348 @@ vector<unique_ptr<Response>> GetResponses(const InputData& input) {
     }
 
     manager.BuildRoutes();
+    return manager;
+}
+
+// A snapshot that cannot be read or fails the checks of its loaders is reported, and
+// nothing is answered from it.
+optional<BusManager> LoadManager(const string& path) {
+    try {
+        const Serialization::MappedFile file(path);
+        Serialization::Reader reader(file.Data(), file.Size());
+        return BusManager(reader);
+    }
+    catch (const exception& e) {
+        cerr << "Cannot load " << path << ": " << e.what() << endl;
+        return nullopt;
+    }
+}
 
+// The manager is only read here, so queries run concurrently and each one fills its
+// own slot, which keeps the responses in request order. Route requests from the same
+// stop go as one task, so they share a single route search.
+vector<unique_ptr<Response>> GetResponses(const InputData& input, const BusManager& manager, ThreadPool& pool) {
+    vector<const Request*> read_requests;
     for (auto& request_holder : input.requests) {
-        if (request_holder->Type == Request::ERequestType::QUERY_BUS) {
-            const auto& request = static_cast<const ReadBusInfoRequest&>(*request_holder);
-            responses.push_back(make_unique<BusInfoResponse>(request.Process(manager)));
-        }
-        else if (request_holder->Type == Request::ERequestType::QUERY_STOP) {
-            const auto& request = static_cast<const ReadStopInfoRequest&>(*request_holder);
-            responses.push_back(make_unique<StopInfoResponse>(request.Process(manager)));
+        if (request_holder->Type != Request::ERequestType::ADD_STOP
+            && request_holder->Type != Request::ERequestType::ADD_BUS) {
+            read_requests.push_back(request_holder.get());
         }
-        else if (request_holder->Type == Request::ERequestType::QUERY_ROUTE) {
-            const auto& request = static_cast<const ReadRouteInfoRequest&>(*request_holder);
-            responses.push_back(make_unique<RouteInfoResponse>(request.Process(manager)));
+    }
+
+    vector<size_t> single_idxs;
+    vector<vector<size_t>> route_groups;
+    unordered_map<string_view, size_t> route_group_by_stop;
+    for (size_t i = 0; i < read_requests.size(); ++i) {
+        if (read_requests[i]->Type != Request::ERequestType::QUERY_ROUTE) {
+            single_idxs.push_back(i);
+            continue;
         }
-        else if (request_holder->Type == Request::ERequestType::QUERY_MAP) {
-            const auto& request = static_cast<const ReadMapInfoRequest&>(*request_holder);
-            responses.push_back(make_unique<MapInfoResponse>(request.Process(manager)));
+        const auto& request = static_cast<const ReadRouteInfoRequest&>(*read_requests[i]);
+        const auto [it, inserted] = route_group_by_stop.emplace(request.GetStopFrom(), route_groups.size());
+        if (inserted) {
+            route_groups.emplace_back();
         }
+        route_groups[it->second].push_back(i);
     }
+
+    vector<unique_ptr<Response>> responses(read_requests.size());
+    pool.ParallelFor(route_groups.size() + single_idxs.size(), [&](size_t task) {
+        if (task >= route_groups.size()) {
+            const size_t i = single_idxs[task - route_groups.size()];
+            responses[i] = ProcessReadRequest(*read_requests[i], manager);
+            return;
+        }
+        const auto& group = route_groups[task];
+        vector<const ReadRouteInfoRequest*> requests;
+        requests.reserve(group.size());
+        for (const size_t i : group) {
+            requests.push_back(static_cast<const ReadRouteInfoRequest*>(read_requests[i]));
+        }
+        auto group_responses = ReadRouteInfoRequest::ProcessFromCommonStop(requests, manager);
+        for (size_t k = 0; k < group.size(); ++k) {
+            responses[group[k]] = make_unique<RouteInfoResponse>(move(group_responses[k]));
+        }
+    });
     return responses;
 }
 
-void PrintResponsesJson(const vector<unique_ptr<Response>>& responses) {
-    auto result_vec = vector<Node>();
-
-    for (const auto& response_ptr: responses) {
-        Node response_node;
-        if (response_ptr->Type == Response::EResponseType::BUS_INFO) {
-            auto cur_node = map<string, Node>{};
-            const auto& response = static_cast<const BusInfoResponse&>(*response_ptr);
-            cur_node["request_id"] = Node(static_cast<double>(response.Request_id));
-            if (response.Info) {
-                cur_node["stop_count"] = Node(static_cast<double>(response.Info.value().CntStops));
-                cur_node["unique_stop_count"] = Node(static_cast<double>(response.Info.value().UniqueStops));
-                cur_node["curvature"] = Node(response.Info.value().Curvature);
-                cur_node["route_length"] = Node(response.Info.value().PathLength);
-            }
-            else {
-                cur_node["error_message"] = Node("not found"s);
+// Keys are written in sorted order, as they would come out of a Json::Node map.
+void WriteResponseJson(Json::Writer& writer, const Response& response_holder) {
+    writer.BeginObject();
+    if (response_holder.Type == Response::EResponseType::BUS_INFO) {
+        const auto& response = static_cast<const BusInfoResponse&>(response_holder);
+        if (response.Info) {
+            writer.Key("curvature");
+            writer.Number(response.Info->Curvature);
+            writer.Key("request_id");
+            writer.Number(response.Request_id);
+            writer.Key("route_length");
+            writer.Number(response.Info->PathLength);
+            writer.Key("stop_count");
+            writer.Number(response.Info->CntStops);
+            writer.Key("unique_stop_count");
+            writer.Number(response.Info->UniqueStops);
+        }
+        else {
+            writer.Key("error_message");
+            writer.String("not found");
+            writer.Key("request_id");
+            writer.Number(response.Request_id);
+        }
+    }
+    else if (response_holder.Type == Response::EResponseType::STOP_INFO) {
+        const auto& response = static_cast<const StopInfoResponse&>(response_holder);
+        if (response.Info) {
+            writer.Key("buses");
+            writer.BeginArray();
+            for (const auto& bus_name : response.Info->Buses) {
+                writer.String(bus_name);
             }
-            response_node = Node(cur_node);
-        }
-        else if (response_ptr->Type == Response::EResponseType::STOP_INFO) {
-            auto cur_node = map<string, Node>{};
-            const auto& response = static_cast<const StopInfoResponse&>(*response_ptr);
-            cur_node["request_id"] = Node(static_cast<double>(response.Request_id));
-            if (response.Info) {
-                auto buses_vector = vector<Node>();
-                for (const auto& bus_name : response.Info.value().Buses) {
-                    buses_vector.push_back(Node(bus_name));
+            writer.EndArray();
+        }
+        else {
+            writer.Key("error_message");
+            writer.String("not found");
+        }
+        writer.Key("request_id");
+        writer.Number(response.Request_id);
+    }
+    else if (response_holder.Type == Response::EResponseType::ROUTE_INFO) {
+        const auto& response = static_cast<const RouteInfoResponse&>(response_holder);
+        if (response.Info) {
+            writer.Key("items");
+            writer.BeginArray();
+            for (const auto& item : response.Info->Items) {
+                writer.BeginObject();
+                if (item.Type == RouteInfoResponse::Item::EType::WAIT) {
+                    writer.Key("stop_name");
+                    writer.String(item.Name);
+                    writer.Key("time");
+                    writer.Number(item.Time);
+                    writer.Key("type");
+                    writer.String("Wait");
                 }
-                cur_node["buses"] = buses_vector;
+                else {
+                    writer.Key("bus");
+                    writer.String(item.Name);
+                    writer.Key("span_count");
+                    writer.Number(item.SpanCount);
+                    writer.Key("time");
+                    writer.Number(item.Time);
+                    writer.Key("type");
+                    writer.String("Bus");
+                }
+                writer.EndObject();
+            }
+            writer.EndArray();
+            writer.Key("map");
+            writer.EscapedString({ *response.Info->Map.Base, response.Info->Map.Overlay });
+            writer.Key("request_id");
+            writer.Number(response.Request_id);
+            writer.Key("total_time");
+            writer.Number(response.Info->TotalTime);
+        }
+        else {
+            writer.Key("error_message");
+            writer.String("not found");
+            writer.Key("request_id");
+            writer.Number(response.Request_id);
+        }
+    }
+    else if (response_holder.Type == Response::EResponseType::MAP_INFO) {
+        const auto& response = static_cast<const MapInfoResponse&>(response_holder);
+        writer.Key("map");
+        writer.EscapedString({ *response.Map.Base, response.Map.Overlay });
+        writer.Key("request_id");
+        writer.Number(response.Request_id);
+    }
+    else {
+        throw runtime_error("Not implemented Response to print");
+    }
+    writer.EndObject();
+}
+
+// Responses go straight to the output buffer.
+void PrintResponsesJson(const vector<unique_ptr<Response>>& responses) {
+    Json::Writer writer(cout);
+    writer.BeginArray();
+    for (const auto& response : responses) {
+        WriteResponseJson(writer, *response);
+    }
+    writer.EndArray();
+}
+
+#ifdef __linux__
+// Answers one stat request line with one response line. A malformed request gets an
+// error_message of its own instead of taking the server down.
+string AnswerRequestLine(string_view line, const BusManager& manager) {
+    thread_local Json::Arena arena;
+    ostringstream out;
+    {
+        Json::Writer writer(out, 4096, Json::Writer::ELayout::SINGLE_LINE);
+        try {
+            arena.Reset();
+            Json::Reader reader(line);
+            const auto& query_node = reader.ReadElement(arena);
+            if (!reader.AtEnd()) {
+                throw invalid_argument("Unexpected data after the request");
             }
-            else {
-                cur_node["error_message"] = Node("not found"s);
+            const string type(query_node.AsMap().at("type").AsString());
+            const auto type_it = ReadRequestTypeByString.find(type);
+            if (type_it == ReadRequestTypeByString.end()) {
+                throw invalid_argument("Unknown request type: " + type);
             }
-            response_node = Node(cur_node);
+            auto request = CreateRequestHolder(type_it->second);
+            request->ReadInfo(query_node);
+            WriteResponseJson(writer, *ProcessReadRequest(*request, manager));
         }
-        else if (response_ptr->Type == Response::EResponseType::ROUTE_INFO) {
-            const auto& response = static_cast<const RouteInfoResponse&>(*response_ptr);
-            response_node = response.Info;
+        catch (const exception& e) {
+            writer.BeginObject();
+            writer.Key("error_message");
+            writer.EscapedString({ e.what() });
+            writer.EndObject();
         }
-        else if (response_ptr->Type == Response::EResponseType::MAP_INFO) {
-            const auto& response = static_cast<const MapInfoResponse&>(*response_ptr);
-            response_node = response.Info;
+    }
+    return out.str();
+}
+
+// Only looks at the type, so a malformed line counts as a query and gets its error
+// from AnswerRequestLine().
+bool IsUpdateLine(string_view line) {
+    try {
+        Json::Reader reader(line);
+        reader.BeginObject();
+        string_view key;
+        while (reader.NextKey(key)) {
+            if (key == "type") {
+                return UpdateRequestTypeByString.count(string(reader.ReadString())) > 0;
+            }
+            reader.SkipValue();
         }
-        else {
-            throw runtime_error("Not implemented Response to print");
+    }
+    catch (const exception&) {
+    }
+    return false;
+}
+
+// Applies one update line and rebuilds what it made stale, so the queries after it see
+// the change. Runs on the server loop while no query does.
+string ApplyUpdateLine(string_view line, BusManager& manager) {
+    static Json::Arena arena;
+    ostringstream out;
+    {
+        Json::Writer writer(out, 4096, Json::Writer::ELayout::SINGLE_LINE);
+        try {
+            arena.Reset();
+            Json::Reader reader(line);
+            const auto& update_node = reader.ReadElement(arena);
+            if (!reader.AtEnd()) {
+                throw invalid_argument("Unexpected data after the request");
+            }
+            const auto& update_map = update_node.AsMap();
+            const int request_id = static_cast<int>(update_map.at("id").AsDouble());
+            auto request = CreateRequestHolder(UpdateRequestTypeByString.at(string(update_map.at("type").AsString())));
+            request->ReadInfo(update_node);
+            static_cast<const ModifyRequest&>(*request).Process(manager);
+            manager.BuildRoutes();
+            writer.BeginObject();
+            writer.Key("request_id");
+            writer.Number(request_id);
+            writer.EndObject();
+        }
+        catch (const exception& e) {
+            writer.BeginObject();
+            writer.Key("error_message");
+            writer.EscapedString({ e.what() });
+            writer.EndObject();
         }
-        result_vec.push_back(response_node);
     }
+    return out.str();
+}
+
+Server* ActiveServer = nullptr;
 
-    auto result_node = Node(result_vec);
-    result_node.Print(cout);
+void StopActiveServer(int) {
+    ActiveServer->Stop();
 }
 
-int main() {
+int Serve(const InputData& input, BusManager& manager, ThreadPool& pool) {
+    Server server(input.socket_path, pool, [&manager](string_view line) {
+        return AnswerRequestLine(line, manager);
+    });
+    server.SetUpdateHandler(IsUpdateLine, [&manager](string_view line) {
+        return ApplyUpdateLine(line, manager);
+    });
+    ActiveServer = &server;
+    signal(SIGINT, StopActiveServer);
+    signal(SIGTERM, StopActiveServer);
+    server.Run();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    ActiveServer = nullptr;
+    return 0;
+}
+#endif
+
+// Without arguments the base and the queries come in one input. "make_base" builds
+// the database and saves it to serialization_settings.file; "process_requests" loads
+// it from there and answers stat_requests. "serve" loads the database the same way,
+// or builds it from base_requests when there is no serialization_settings, and then
+// answers requests on server_settings.socket until it gets SIGINT or SIGTERM. Besides
+// stat requests it takes UpdateStop, UpdateBus, RemoveStop and RemoveBus, each with an
+// id, which change the database in place and are answered with just the request_id.
+int main(int argc, const char* argv[]) {
     //FILE* file;
 	//freopen_s(&file, "C:\\Users\\Admin\\source\\repos\\BlackBelt\\Solutions\\BusManager\\a.in", "r", stdin);
 
     //FILE* file2;
 	//freopen_s(&file2, "C:\\Users\\Admin\\source\\repos\\BlackBelt\\Solutions\\BusManager\\map.svg", "w", stdout);
 
-	auto requests = ReadAllRequestsJson();
-	const auto responses = GetResponses(move(requests));
-	PrintResponsesJson(responses);
+	const string mode = argc > 1 ? argv[1] : "";
+	if (!mode.empty() && mode != "make_base" && mode != "process_requests" && mode != "serve") {
+		cerr << "Usage: " << argv[0] << " [make_base|process_requests|serve]" << endl;
+		return 1;
+	}
+
+	const auto input = ReadAllRequestsJson();
+	if (mode == "make_base") {
+		const auto manager = BuildManager(input);
+		ofstream out(input.serialization_file, ios::binary);
+		manager.Serialize(out);
+		return out ? 0 : 1;
+	}
+
+	ThreadPool pool;
+	if (mode == "serve") {
+#ifdef __linux__
+		if (!input.serialization_file.empty()) {
+			auto manager = LoadManager(input.serialization_file);
+			if (!manager) {
+				return 1;
+			}
+			manager->SetThreadPool(&pool);
+			return Serve(input, *manager, pool);
+		}
+		auto manager = BuildManager(input);
+		manager.SetThreadPool(&pool);
+		return Serve(input, manager, pool);
+#else
+		cerr << "serve mode needs Unix domain sockets and epoll, which are Linux only" << endl;
+		return 1;
+#endif
+	}
+	if (mode == "process_requests") {
+		auto manager = LoadManager(input.serialization_file);
+		if (!manager) {
+			return 1;
+		}
+		manager->SetThreadPool(&pool);
+		PrintResponsesJson(GetResponses(input, *manager, pool));
+		return 0;
+	}
+
+	auto manager = BuildManager(input);
+	manager.SetThreadPool(&pool);
+	PrintResponsesJson(GetResponses(input, manager, pool));
 }
@@ -1,16 +1,23 @@
 #pragma once
 
+#include "coordinate_compression.h"
 #include "json.h"
+#include "name_table.h"
+#include "packed_key_map.h"
 #include "router.h"
+#include "serialization.h"
 #include "svg.h"
 #include "responses.h"
+#include "thread_pool.h"
 
 #include <cassert>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <sstream>
@@ -20,11 +27,16 @@
 #include <cmath>
 #include <functional>
 #include <set>
+#include <numeric>
+#include <tuple>
 
 using namespace std;
 
 const double PI = 3.1415926535;
 const double RADIUS = 6371;
+// Start of a file written by BusManager::Serialize(); bump the version on format changes.
+const uint32_t SNAPSHOT_MAGIC = 0x42444d42;
+const uint32_t SNAPSHOT_VERSION = 5;
 
 struct Location {
     double Latitude = 0.0;
@@ -38,51 +50,110 @@ struct Location {
     }
 };
 
+using StopId = NameTable::Id;
+using BusId = NameTable::Id;
+
 struct Stop {
     Location StopLocation;
-    set<string> BusesNames;
+    // Ids get interned for stops that are only mentioned in distances or bus routes.
+    bool IsDefined = false;
+    // Sorted by bus name once all buses are added; updates keep it sorted.
+    vector<BusId> BusIds;
+
+    void Serialize(ostream& out) const {
+        using Serialization::Serialize;
+        Serialize(StopLocation, out);
+        Serialize(IsDefined, out);
+        Serialize(BusIds, out);
+    }
+
+    void Deserialize(Serialization::Reader& in) {
+        using Serialization::Deserialize;
+        Deserialize(in, StopLocation);
+        Deserialize(in, IsDefined);
+        Deserialize(in, BusIds);
+    }
+};
+
+// Road distances between stops in one flat table keyed by packed (from, to) ids, so a
+// lookup is one or two probes. A distance given for one direction also serves the
+// other one until that direction gets its own. Only given directions are stored, so
+// changing one later is seen from the other side as well.
+class RoadDistances {
+public:
+    void Add(StopId from, StopId to, double distance) {
+        Table[PackedKeyMap<double>::PackKey(from, to)] = distance;
+    }
+
+    optional<double> Find(StopId from, StopId to) const {
+        const double* distance = Table.Find(PackedKeyMap<double>::PackKey(from, to));
+        if (!distance) {
+            distance = Table.Find(PackedKeyMap<double>::PackKey(to, from));
+        }
+        if (!distance) {
+            return nullopt;
+        }
+        return *distance;
+    }
+
+    size_t Size() const {
+        return Table.Size();
+    }
+
+    void Serialize(ostream& out) const {
+        Table.Serialize(out);
+    }
+
+    void Deserialize(Serialization::Reader& in) {
+        Table.Deserialize(in);
+    }
+
+private:
+    PackedKeyMap<double> Table;
 };
 
 struct Bus {
     Bus() {}
     
-    Bus(const vector<string>& path, const map<string, Stop>& stops, 
-        const unordered_map<string, unordered_map<string, double>>& distances_between_stops, bool is_round_trip) {
+    Bus(const vector<StopId>& path, const vector<Stop>& stops, 
+        const RoadDistances& distances_between_stops, bool is_round_trip) {
         IsRoundTrip = is_round_trip;
         RouteLength = 0;
         GeoLength = 0;
-        set<string> unique_stops;
-        for (size_t i = 0; i < path.size(); ++i) {
-            unique_stops.insert(path[i]);
-            if (i) {
-                double geo_dist = stops.at(path[i - 1]).StopLocation.Distance(stops.at(path[i]).StopLocation);
-                GeoLength += geo_dist;
-                if (distances_between_stops.count(path[i - 1]) && 
-                    distances_between_stops.at(path[i - 1]).count(path[i])) {
-                    RouteLength += distances_between_stops.at(path[i - 1]).at(path[i]);
-                }
-                else {
-                    string msg;
-                    for (const auto& el : distances_between_stops) {
-                        msg += el.first + ":\n";
-                        for (const auto& e : el.second) {
-                            msg += "  " + e.first + ":" + to_string(e.second) + "\n";
-                        }
-                    }
-
-                    //throw runtime_error("error: " + msg);
-                    RouteLength += geo_dist;
-                }
-            }
+        vector<StopId> unique_stops = path;
+        sort(unique_stops.begin(), unique_stops.end());
+        CntUnique = static_cast<int>(unique(unique_stops.begin(), unique_stops.end()) - unique_stops.begin());
+        for (size_t i = 1; i < path.size(); ++i) {
+            assert(stops[path[i - 1]].IsDefined && stops[path[i]].IsDefined);
+            double geo_dist = stops[path[i - 1]].StopLocation.Distance(stops[path[i]].StopLocation);
+            GeoLength += geo_dist;
+            RouteLength += distances_between_stops.Find(path[i - 1], path[i]).value_or(geo_dist);
         }
-        CntUnique = static_cast<int>(unique_stops.size());
         Stops = path;
     }
     double RouteLength = 0;
     double GeoLength = 0;
     int CntUnique = 0;
     bool IsRoundTrip = false;
-    vector<string> Stops;
+    vector<StopId> Stops;
+
+    void Serialize(ostream& out) const {
+        using Serialization::Serialize;
+        Serialize(RouteLength, out);
+        Serialize(GeoLength, out);
+        Serialize(CntUnique, out);
+        Serialize(IsRoundTrip, out);
+        Serialize(Stops, out);
+    }
+
+    void Deserialize(Serialization::Reader& in) {
+        using Serialization::Deserialize;
+        Deserialize(in, RouteLength);
+        Deserialize(in, GeoLength);
+        Deserialize(in, CntUnique);
+        Deserialize(in, IsRoundTrip);
+        Deserialize(in, Stops);
+    }
 
     BusInfoResponse GetInfo(const string& name) const {
         double curvature = RouteLength / GeoLength;
@@ -92,6 +163,14 @@ struct Bus {
 };
 
 
+// DIRECT connects every pair of stops of a bus with one edge; LAYERED adds a vertex per
+// stop of every bus route, which keeps the graph linear in total route length. Both
+// give the same route times, but not always the same items when routes tie.
+enum class EGraphModel {
+    DIRECT,
+    LAYERED
+};
+
 struct BusManagerSettings {
     BusManagerSettings() 
         : BusWaitTime(0)
@@ -105,12 +184,17 @@ struct BusManagerSettings {
 
     int BusWaitTime;
     int BusVelocity;
+    // Never switched automatically: the modes agree on route times, but of several
+    // equally fast routes each may pick a different one. Large inputs should ask for
+    // DIJKSTRA or CONTRACTION_HIERARCHY.
+    Graph::ERouterMode RouterMode = Graph::ERouterMode::ALL_PAIRS;
+    EGraphModel GraphModel = EGraphModel::DIRECT;
 };
 
 class RenderSettings {
 public:
     RenderSettings() {}
-    RenderSettings(const map<string, Json::Node>& node) {
+    RenderSettings(const Json::ElementObject& node) {
         width = node.at("width").AsDouble(); 
         height = node.at("height").AsDouble();
         padding = node.at("padding").AsDouble();
@@ -134,6 +218,53 @@ public:
         }
     }
 
+    void Serialize(ostream& out) const {
+        using Serialization::Serialize;
+        Serialize(width, out);
+        Serialize(height, out);
+        Serialize(padding, out);
+        Serialize(stop_radius, out);
+        Serialize(line_width, out);
+        Serialize(outer_margin, out);
+        Serialize(stop_label_font_size, out);
+        Serialize(stop_label_offset, out);
+        Serialize(underlayer_color.ToString(), out);
+        Serialize(underlayer_width, out);
+        Serialize(color_palette.size(), out);
+        for (const auto& color : color_palette) {
+            Serialize(color.ToString(), out);
+        }
+        Serialize(bus_label_font_size, out);
+        Serialize(bus_label_offset, out);
+        Serialize(layers, out);
+    }
+
+    void Deserialize(Serialization::Reader& in) {
+        using Serialization::Deserialize;
+        Deserialize(in, width);
+        Deserialize(in, height);
+        Deserialize(in, padding);
+        Deserialize(in, stop_radius);
+        Deserialize(in, line_width);
+        Deserialize(in, outer_margin);
+        Deserialize(in, stop_label_font_size);
+        Deserialize(in, stop_label_offset);
+        string color_value;
+        Deserialize(in, color_value);
+        underlayer_color = Svg::Color(color_value);
+        Deserialize(in, underlayer_width);
+        size_t color_count;
+        Deserialize(in, color_count);
+        color_palette.clear();
+        for (size_t i = 0; i < color_count; ++i) {
+            Deserialize(in, color_value);
+            color_palette.emplace_back(color_value);
+        }
+        Deserialize(in, bus_label_font_size);
+        Deserialize(in, bus_label_offset);
+        Deserialize(in, layers);
+    }
+
     double width;
     double height;
     double padding;
@@ -150,7 +281,7 @@ public:
     vector<string> layers;
 
 private:
-    Svg::Color ParseColor(const Json::Node& node) {
+    Svg::Color ParseColor(const Json::Element& node) {
         using namespace Json;
         using namespace Svg;
         if (node.IsArray()) {
@@ -167,7 +298,7 @@ private:
                     tmp[3].AsDouble()));
             }
         } else {
-            return Color(node.AsString());
+            return Color(string(node.AsString()));
         }
     }
 };
@@ -179,219 +310,526 @@ public:
         , RenderSettings_(render_settings)
     {}
 
+    // Rendering of the base map is spread over the pool. Without one, everything
+    // runs on the calling thread.
+    void SetThreadPool(ThreadPool* pool) {
+        Pool = pool;
+    }
+
+    // Restores a manager written by Serialize(); it is ready for queries right away.
+    explicit BusManager(Serialization::Reader& in) {
+        using Serialization::Deserialize;
+        uint32_t magic, version;
+        Deserialize(in, magic);
+        Deserialize(in, version);
+        if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION) {
+            throw runtime_error("Not a transport database or an unsupported version");
+        }
+
+        Deserialize(in, BusManagerSettings_.BusWaitTime);
+        Deserialize(in, BusManagerSettings_.BusVelocity);
+        Deserialize(in, BusManagerSettings_.RouterMode);
+        Deserialize(in, BusManagerSettings_.GraphModel);
+        RenderSettings_.Deserialize(in);
+
+        StopNames.Deserialize(in);
+        BusNames.Deserialize(in);
+        Stops.resize(StopNames.Size());
+        for (auto& stop : Stops) {
+            stop.Deserialize(in);
+        }
+        Buses.resize(BusNames.Size());
+        for (auto& bus : Buses) {
+            bus.Deserialize(in);
+        }
+        Deserialize(in, StopsByName);
+        Deserialize(in, BusesByName);
+        DistancesBetweenStops.Deserialize(in);
+
+        Deserialize(in, VertexByStop);
+        Deserialize(in, Edges);
+        Deserialize(in, LayeredEdges);
+        GraphPtr = make_shared<Graph::DirectedWeightedGraph<double>>(in);
+        RouteBuilder = make_unique<Graph::Router<double>>(*GraphPtr, in);
+        CheckLoadedIds();
+    }
+
     void AddStop(const string& name, Location location, const unordered_map<string, double>& dist_by_stop) {
-        Stops[name] = Stop{ location };
+        const StopId stop_id = InternStop(name);
+        Stops[stop_id].StopLocation = location;
+        Stops[stop_id].IsDefined = true;
         for (const auto& [stop_name, dist] : dist_by_stop) {
-            DistancesBetweenStops[name][stop_name] = dist;
-            if (!DistancesBetweenStops.count(stop_name) || !DistancesBetweenStops[stop_name].count(name)) {
-                DistancesBetweenStops[stop_name][name] = dist;
-            }
+            DistancesBetweenStops.Add(stop_id, InternStop(stop_name), dist);
         }
     }
 
     void AddBus(const string& name, const vector<string>& path, bool is_round_trip) {
-        Buses[name] = Bus(path, Stops, DistancesBetweenStops, is_round_trip);
+        vector<StopId> stop_ids;
+        stop_ids.reserve(path.size());
         for (const auto& stop_name : path) {
-            assert(Stops.count(stop_name));
-            Stops[stop_name].BusesNames.insert(name);
+            stop_ids.push_back(InternStop(stop_name));
         }
-    }
 
-    BusInfoResponse GetBusInfoResponse(const string& bus_name) {
-        auto iter = Buses.find(bus_name);
-        if (iter == Buses.end()) {
-            return { bus_name, nullopt };
+        const BusId bus_id = BusNames.Intern(name);
+        if (bus_id == Buses.size()) {
+            Buses.emplace_back();
         }
-        return iter->second.GetInfo(bus_name);
-    }
-
-    StopInfoResponse GetStopInfoResponse(const string& stop_name) {
-        auto iter = Stops.find(stop_name);
-        if (iter == Stops.end()) {
-            return StopInfoResponse{ stop_name, nullopt };
+        Buses[bus_id] = Bus(stop_ids, Stops, DistancesBetweenStops, is_round_trip);
+        for (const StopId stop_id : stop_ids) {
+            assert(Stops[stop_id].IsDefined);
+            auto& bus_ids = Stops[stop_id].BusIds;
+            if (find(bus_ids.begin(), bus_ids.end(), bus_id) == bus_ids.end()) {
+                bus_ids.push_back(bus_id);
+            }
         }
-        return StopInfoResponse{ stop_name, StopInfoResponse::BusesInfo{ iter->second.BusesNames } };
     }
 
-    RouteInfoResponse GetRouteResponse(const string& stop_from, const string& stop_to) {
-        using namespace Json;
-        using namespace Svg;
+    // Changes to a database that has been through BuildRoutes(). Bus metrics, name
+    // orders and stop bus lists are patched right away; routes and the map follow on
+    // the next BuildRoutes(), which redoes only what the changes made stale. Queries
+    // have to wait for it.
+    //
+    // The map layout is not split into parts that could be redone separately: stops are
+    // spread between pivots and compressed against all their neighbours, so moving one
+    // stop or rerouting one bus can shift any other stop. It is kept by changes that
+    // leave stop locations and bus routes as they are, such as new road distances, and
+    // recomputed whole by the others.
 
-        size_t from_id = StopIdByName[stop_from];
-        size_t to_id = StopIdByName[stop_to];
-        auto route = RouteBuilder->BuildRoute(from_id, to_id);
-        if (!route) {
-            auto node_map = map<string, Node>();
-            node_map["error_message"] = Node("not found"s);
-            return RouteInfoResponse(Node(node_map));
-        }
-
-        auto node_map = map<string, Node>();
-        auto result = route.value();
-        node_map["total_time"] = Node(result.weight);
-        auto node_map_items = vector<Node>();
-        vector<int> edges_ids;
-        for (size_t i = 0; i < result.edge_count; ++i) {
-            auto edge_id = RouteBuilder->GetRouteEdge(result.id, i);
-            auto wait_node_map = map<string, Node>();
-            wait_node_map["time"] = Node(static_cast<double>(BusManagerSettings_.BusWaitTime));
-            wait_node_map["type"] = Node("Wait"s);
-            wait_node_map["stop_name"] = Node(Edges[edge_id].StopFrom);
-            node_map_items.push_back(Node(wait_node_map));
-
-            auto ride_node_map = map<string, Node>();
-            ride_node_map["bus"] = Node(Edges[edge_id].BusName);
-            ride_node_map["type"] = Node("Bus"s);
-            ride_node_map["time"] = Node(Edges[edge_id].Weight - BusManagerSettings_.BusWaitTime);
-            ride_node_map["span_count"] = Node(Edges[edge_id].SpanCount);
-            node_map_items.push_back(Node(ride_node_map));
-        }
-        node_map["items"] = Node(node_map_items);
-
-
-        auto map_info = ComputeMapInfo();
-        Svg::Document svg_doc = BuildMapSvgDocument(map_info);
-        AddOpaqueRectToSvg(svg_doc);
-        AddPathsToSvg(map_info, svg_doc, result);
+    // Adds a stop or moves an existing one and sets the given road distances from it.
+    void UpdateStop(const string& name, Location location, const unordered_map<string, double>& dist_by_stop) {
+        const StopId stop_id = InternUpdatedStop(name);
+        auto& stop = Stops[stop_id];
+        const bool is_moved = stop.StopLocation.Latitude != location.Latitude
+            || stop.StopLocation.Longitude != location.Longitude;
+        if (!stop.IsDefined) {
+            stop.IsDefined = true;
+            InsertByName(StopsByName, stop_id, StopNames);
+            // Stop vertices follow name order among defined stops.
+            Pending.IsRoutingStale = true;
+            Pending.IsLayoutStale = true;
+        }
+        if (is_moved) {
+            stop.StopLocation = location;
+            // Moving a stop changes geographic lengths, but not span times.
+            for (const BusId bus_id : stop.BusIds) {
+                RecomputeBusMetrics(bus_id);
+            }
+            Pending.IsLayoutStale = true;
+        }
 
-        stringstream ss;
-        svg_doc.Render(ss);
-        auto raw_text = ss.str();
+        for (const auto& [stop_name, dist] : dist_by_stop) {
+            UpdateDistance(stop_id, InternUpdatedStop(stop_name), dist);
+        }
+    }
 
-        /*
-        std::ofstream fout;
-        fout.open("C:\\Users\\Admin\\source\\repos\\BlackBelt\\Solutions\\BusManager\\map.svg");
-        fout << raw_text << endl;
-        fout.close();
-        */
+    // Only stops no bus goes through can be removed.
+    void RemoveStop(const string& name) {
+        const auto stop_id = FindDefinedStop(name);
+        if (!stop_id) {
+            return;
+        }
+        if (!Stops[*stop_id].BusIds.empty()) {
+            throw invalid_argument("Stop " + name + " is on a bus route");
+        }
+        Stops[*stop_id].IsDefined = false;
+        EraseId(StopsByName, *stop_id);
+        Pending.IsRoutingStale = true;
+        Pending.IsLayoutStale = true;
+    }
+
+    void SetDistance(const string& from, const string& to, double distance) {
+        UpdateDistance(InternUpdatedStop(from), InternUpdatedStop(to), distance);
+    }
 
-        string added_slashes = "";
-        for (const auto ch: raw_text) {
-            if (ch == '\"') {
-                added_slashes += '\\'; 
+    // Adds a bus or replaces the route of an existing one. Its stops have to exist.
+    void UpdateBus(const string& name, const vector<string>& path, bool is_round_trip) {
+        if (path.empty()) {
+            throw invalid_argument("Bus " + name + " has no stops");
+        }
+        vector<StopId> stop_ids;
+        stop_ids.reserve(path.size());
+        for (const auto& stop_name : path) {
+            const auto stop_id = FindDefinedStop(stop_name);
+            if (!stop_id) {
+                throw invalid_argument("Bus " + name + " goes through unknown stop " + stop_name);
             }
-            added_slashes += ch;
+            stop_ids.push_back(*stop_id);
         }
 
-        node_map["map"] = Node(added_slashes);
-        return RouteInfoResponse(Node(node_map));
+        const BusId bus_id = BusNames.Intern(name);
+        if (bus_id == Buses.size()) {
+            Buses.emplace_back();
+        }
+        if (Buses[bus_id].Stops == stop_ids && Buses[bus_id].IsRoundTrip == is_round_trip) {
+            return;
+        }
+        if (Buses[bus_id].Stops.empty()) {
+            InsertByName(BusesByName, bus_id, BusNames);
+        }
+        DetachBus(bus_id);
+        Buses[bus_id] = Bus(stop_ids, Stops, DistancesBetweenStops, is_round_trip);
+        for (const StopId stop_id : stop_ids) {
+            InsertByName(Stops[stop_id].BusIds, bus_id, BusNames);
+        }
+        Pending.IsRoutingStale = true;
+        Pending.IsLayoutStale = true;
     }
 
+    // The name stays interned; a bus without stops counts as absent.
+    void RemoveBus(const string& name) {
+        const auto bus_id = BusNames.Find(name);
+        if (!bus_id || Buses[*bus_id].Stops.empty()) {
+            return;
+        }
+        DetachBus(*bus_id);
+        Buses[*bus_id] = Bus();
+        EraseId(BusesByName, *bus_id);
+        Pending.IsRoutingStale = true;
+        Pending.IsLayoutStale = true;
+    }
 
-    MapInfoResponse GetMapInfoResponse() {
-        using namespace Svg; 
-        using namespace Json;
+    BusInfoResponse GetBusInfoResponse(const string& bus_name) const {
+        auto bus_id = BusNames.Find(bus_name);
+        if (!bus_id || Buses[*bus_id].Stops.empty()) {
+            return { bus_name, nullopt };
+        }
+        return Buses[*bus_id].GetInfo(bus_name);
+    }
+
+    StopInfoResponse GetStopInfoResponse(const string& stop_name) const {
+        auto stop_id = FindDefinedStop(stop_name);
+        if (!stop_id) {
+            return StopInfoResponse{ stop_name, nullopt };
+        }
+        set<string> bus_names;
+        for (const BusId bus_id : Stops[*stop_id].BusIds) {
+            bus_names.insert(BusNames.GetName(bus_id));
+        }
+        return StopInfoResponse{ stop_name, StopInfoResponse::BusesInfo{ move(bus_names) } };
+    }
 
-        auto map_info = ComputeMapInfo();
-        Svg::Document svg_doc = BuildMapSvgDocument(map_info);
-        stringstream ss;
-        svg_doc.Render(ss);
-        auto raw_text = ss.str();
+    RouteInfoResponse GetRouteResponse(const string& stop_from, const string& stop_to) const {
+        auto from_id = FindDefinedStop(stop_from);
+        auto to_id = FindDefinedStop(stop_to);
+        auto route = from_id && to_id
+            ? RouteBuilder->BuildRoute(VertexByStop[*from_id], VertexByStop[*to_id])
+            : nullopt;
+        if (!route) {
+            return RouteInfoResponse(nullopt);
+        }
+        return MakeRouteResponse(route->weight, GetRouteRides(*route));
+    }
 
-        /*
-        std::ofstream fout;
-        fout.open("C:\\Users\\Admin\\source\\repos\\BlackBelt\\Solutions\\BusManager\\map.svg");
-        fout << raw_text << endl;
-        fout.close();
-        */
+    // Answers routes from one stop to each of stops_to, finding them together where the
+    // router can. The routes are found one after another and rendered on the pool.
+    vector<RouteInfoResponse> GetRouteResponses(const string& stop_from, const vector<string>& stops_to) const {
+        vector<RouteInfoResponse> responses(stops_to.size(), RouteInfoResponse(nullopt));
+        const auto from_id = FindDefinedStop(stop_from);
+        if (!from_id) {
+            return responses;
+        }
 
-        string added_slashes = "";
-        for (const auto ch: raw_text) {
-            if (ch == '\"') {
-                added_slashes += '\\'; 
+        vector<size_t> found_idxs;
+        vector<Graph::VertexId> targets;
+        for (size_t i = 0; i < stops_to.size(); ++i) {
+            if (const auto to_id = FindDefinedStop(stops_to[i])) {
+                found_idxs.push_back(i);
+                targets.push_back(VertexByStop[*to_id]);
             }
-            added_slashes += ch;
         }
-        map<string, Node> result = {{"map", Node(added_slashes)}};
-        return MapInfoResponse(Node(result));
+
+        struct FoundRoute {
+            double Weight;
+            vector<EdgeInfo> Rides;
+        };
+        vector<optional<FoundRoute>> routes(targets.size());
+        RouteBuilder->BuildRoutesFrom(VertexByStop[*from_id], targets, [&](size_t i, const auto& route) {
+            if (route) {
+                routes[i] = FoundRoute{ route->weight, GetRouteRides(*route) };
+            }
+        });
+        ParallelFor(routes.size(), [&](size_t i) {
+            if (routes[i]) {
+                responses[found_idxs[i]] = MakeRouteResponse(routes[i]->Weight, routes[i]->Rides);
+            }
+        });
+        return responses;
+    }
+
+    MapInfoResponse GetMapInfoResponse() const {
+        string footer;
+        Svg::Document::RenderFooter(footer);
+        return MapInfoResponse({ GetMapCache().BaseSvg, move(footer) });
     }
     
+    // The first call builds everything. Later ones follow the update methods: a graph
+    // whose routes changed is built anew, one where only span times changed gets new
+    // edge weights in place, and the map is dropped only when its layout changed.
     void BuildRoutes() {
 		using namespace Graph;
 
-		size_t cur_stop_idx = 0;
-		for (const auto& [name, Stop] : Stops) {
-			StopIdByName[name] = cur_stop_idx++;
+		if (!GraphPtr) {
+			SortIdsByName();
+			Pending.IsRoutingStale = true;
+			Pending.IsLayoutStale = true;
 		}
-
-		GraphPtr = make_shared<DirectedWeightedGraph<double>>(Stops.size());
-
-		map<pair<string, string>, tuple<double, string, int>> best_bus_by_2_stops;
-
-		for (const auto& [bus_name, bus] : Buses) {
-			for (size_t first_pos = 0; first_pos + 1 < bus.Stops.size(); ++first_pos) {
-				double weight = BusManagerSettings_.BusWaitTime;
-				for (size_t second_pos = first_pos + 1; second_pos < bus.Stops.size(); ++second_pos) {
-					weight += DistancesBetweenStops[bus.Stops[second_pos - 1]][bus.Stops[second_pos]] /
-						(BusManagerSettings_.BusVelocity * 1000 / 60.);
-					if (!best_bus_by_2_stops.count({ bus.Stops[first_pos], bus.Stops[second_pos] })) {
-						best_bus_by_2_stops[{bus.Stops[first_pos], bus.Stops[second_pos]}] =
-							make_tuple(weight, bus_name, static_cast<int>(second_pos - first_pos));
-					}
-					else {
-						best_bus_by_2_stops[{bus.Stops[first_pos], bus.Stops[second_pos]}] =
-							min(make_tuple(weight, bus_name, static_cast<int>(second_pos - first_pos)),
-								best_bus_by_2_stops[{bus.Stops[first_pos], bus.Stops[second_pos]}]);
-					}
-				}
+		if (Pending.IsRoutingStale) {
+			Edges.clear();
+			LayeredEdges.clear();
+			NumberStopVertices();
+			if (BusManagerSettings_.GraphModel == EGraphModel::LAYERED) {
+				BuildLayeredGraph();
+			}
+			else {
+				BuildDirectGraph();
+			}
+			GraphPtr->Freeze();
+		}
+		else if (!Pending.RetimedBuses.empty()) {
+			vector<bool> is_retimed(Buses.size(), false);
+			for (const BusId bus_id : Pending.RetimedBuses) {
+				is_retimed[bus_id] = true;
+			}
+			if (BusManagerSettings_.GraphModel == EGraphModel::LAYERED) {
+				RetimeLayeredGraph(is_retimed);
+			}
+			else {
+				RetimeDirectGraph(is_retimed);
 			}
 		}
 
-		for (const auto& el : best_bus_by_2_stops) {
-			const auto& [from_stop, to_stop] = el.first;
-			const auto& [dist, bus_name, span_count] = el.second;
-			Edge<double> edge{ StopIdByName[from_stop], StopIdByName[to_stop], dist };
-			auto edge_id = GraphPtr->AddEdge(edge);
-			Edges.push_back({ dist, from_stop, to_stop, bus_name, edge_id, span_count });
+		const bool is_graph_changed = Pending.IsRoutingStale || !Pending.RetimedBuses.empty();
+		if (Pending.IsLayoutStale) {
+			MapCache_ = make_unique<MapCache>();
+		}
+		Pending = {};
+		if (!is_graph_changed) {
+			return;
 		}
+		RouteBuilder = make_unique<Graph::Router<double>>(*GraphPtr, BusManagerSettings_.RouterMode);
+    }
+
+    // Writes the database together with the routing graph and router data, so that
+    // another process can answer queries without going through BuildRoutes() again.
+    void Serialize(ostream& out) const {
+        using Serialization::Serialize;
+        Serialize(SNAPSHOT_MAGIC, out);
+        Serialize(SNAPSHOT_VERSION, out);
 
-		RouteBuilder = make_unique<Graph::Router<double>>(*GraphPtr);
+        Serialize(BusManagerSettings_.BusWaitTime, out);
+        Serialize(BusManagerSettings_.BusVelocity, out);
+        Serialize(BusManagerSettings_.RouterMode, out);
+        Serialize(BusManagerSettings_.GraphModel, out);
+        RenderSettings_.Serialize(out);
+
+        StopNames.Serialize(out);
+        BusNames.Serialize(out);
+        for (const auto& stop : Stops) {
+            stop.Serialize(out);
+        }
+        for (const auto& bus : Buses) {
+            bus.Serialize(out);
+        }
+        Serialize(StopsByName, out);
+        Serialize(BusesByName, out);
+        DistancesBetweenStops.Serialize(out);
+
+        Serialize(VertexByStop, out);
+        Serialize(Edges, out);
+        Serialize(LayeredEdges, out);
+        GraphPtr->Serialize(out);
+        RouteBuilder->Serialize(out);
     }
 
 private:
+    // One ride on one bus: waiting at StopFrom plus SpanCount spans to StopTo. The
+    // ride covers Buses[Bus].Stops from StartPos on, so its stops are a plain slice.
+    struct EdgeInfo {
+        double Weight;
+        StopId StopFrom;
+        StopId StopTo;
+        BusId Bus;
+        int SpanCount;
+        uint32_t StartPos;
+    };
+
+    Range<const StopId*> GetRideStops(const EdgeInfo& ride) const {
+        const StopId* begin = Buses[ride.Bus].Stops.data() + ride.StartPos;
+        return { begin, begin + ride.SpanCount + 1 };
+    }
+
 	struct StopInfo {
 		double lat;
 		double lon;
-		string name;
+		StopId id;
 	};
 
-    using MapInfo = map<string, StopInfo>;
+    // Placement of everything on the map, computed once and shared by all SVG adders:
+    // projected stop positions by StopId and palette indices by BusId.
+    struct MapInfo {
+        vector<Svg::Point> StopPoints;
+        vector<uint32_t> BusColorIdx;
+    };
+
+    // Stop layout and the base map depend only on data fixed by BuildRoutes(), so they
+    // are computed by the first Map or Route query and reused by all later ones.
+    struct MapCache {
+        once_flag Once;
+        MapInfo Layout;
+        // SVG up to the end of the map layers and without the closing tag, so a
+        // route overlay can follow. Responses share it instead of copying.
+        shared_ptr<const string> BaseSvg;
+    };
 
-    vector<int> GetIdsAfterCompress(
-        vector<StopInfo>& stops_points, 
-        set<pair<string, string>>& neighbour_stops
-    ) {
-        vector<int> id_after_compress(stops_points.size(), -1);
-        for (size_t i = 0; i < stops_points.size(); ++i) {
-            int max_neighbour_id = -1;
-            for (size_t j = 0; j < i; ++j) {
-                if (neighbour_stops.count({ stops_points[i].name, stops_points[j].name })) {
-                    max_neighbour_id = max(max_neighbour_id, id_after_compress[j]);
+    const MapCache& GetMapCache() const {
+        call_once(MapCache_->Once, [this] {
+            MapCache_->Layout = ComputeMapInfo();
+            MapCache_->BaseSvg = make_shared<const string>(RenderMapSvg(MapCache_->Layout));
+        });
+        return *MapCache_;
+    }
+
+    StopId InternStop(const string& name) {
+        const StopId stop_id = StopNames.Intern(name);
+        if (stop_id == Stops.size()) {
+            Stops.emplace_back();
+        }
+        return stop_id;
+    }
+
+    // Names are also interned for stops that are only mentioned in road distances or
+    // were removed; queries treat those as unknown.
+    optional<StopId> FindDefinedStop(const string& name) const {
+        const auto stop_id = StopNames.Find(name);
+        if (!stop_id || !Stops[*stop_id].IsDefined) {
+            return nullopt;
+        }
+        return stop_id;
+    }
+
+    // A stop interned after BuildRoutes() has no vertex yet, so the graph has to be
+    // built anew.
+    StopId InternUpdatedStop(const string& name) {
+        const size_t stop_count = Stops.size();
+        const StopId stop_id = InternStop(name);
+        if (Stops.size() != stop_count) {
+            Pending.IsRoutingStale = true;
+        }
+        return stop_id;
+    }
+
+    static auto ByName(const NameTable& names) {
+        return [&names](NameTable::Id lhs, NameTable::Id rhs) {
+            return names.GetName(lhs) < names.GetName(rhs);
+        };
+    }
+
+    // Rendering and tie-breaking between buses follow name order, as the output expects.
+    void SortIdsByName() {
+        StopsByName.clear();
+        for (StopId stop_id = 0; stop_id < Stops.size(); ++stop_id) {
+            if (Stops[stop_id].IsDefined) {
+                StopsByName.push_back(stop_id);
+            }
+        }
+        sort(StopsByName.begin(), StopsByName.end(), ByName(StopNames));
+
+        BusesByName.resize(Buses.size());
+        iota(BusesByName.begin(), BusesByName.end(), 0);
+        sort(BusesByName.begin(), BusesByName.end(), ByName(BusNames));
+
+        for (auto& stop : Stops) {
+            sort(stop.BusIds.begin(), stop.BusIds.end(), ByName(BusNames));
+        }
+    }
+
+    // Graph vertices of stops are numbered in name order, with the stops that are not
+    // defined last, so that the search meets stops and edges in the same order as
+    // when stops were keyed by name. Each graph model and router mode then picks the
+    // same one of several equally fast routes as it did before; different modes still
+    // pick different ones.
+    void NumberStopVertices() {
+        VertexByStop.assign(Stops.size(), 0);
+        Graph::VertexId vertex = 0;
+        for (const StopId stop_id : StopsByName) {
+            VertexByStop[stop_id] = vertex++;
+        }
+        for (StopId stop_id = 0; stop_id < Stops.size(); ++stop_id) {
+            if (!Stops[stop_id].IsDefined) {
+                VertexByStop[stop_id] = vertex++;
+            }
+        }
+    }
+
+    // Updates keep the name orders sorted instead of sorting them again.
+    static void InsertByName(vector<NameTable::Id>& ids, NameTable::Id id, const NameTable& names) {
+        const auto it = lower_bound(ids.begin(), ids.end(), id, ByName(names));
+        if (it == ids.end() || *it != id) {
+            ids.insert(it, id);
+        }
+    }
+
+    static void EraseId(vector<NameTable::Id>& ids, NameTable::Id id) {
+        ids.erase(remove(ids.begin(), ids.end(), id), ids.end());
+    }
+
+    void DetachBus(BusId bus_id) {
+        for (const StopId stop_id : Buses[bus_id].Stops) {
+            EraseId(Stops[stop_id].BusIds, bus_id);
+        }
+    }
+
+    void RecomputeBusMetrics(BusId bus_id) {
+        const auto& bus = Buses[bus_id];
+        Buses[bus_id] = Bus(bus.Stops, Stops, DistancesBetweenStops, bus.IsRoundTrip);
+    }
+
+    // Only buses with a span between the two stops, in either direction, are affected:
+    // their lengths and span times change, their routes do not.
+    void UpdateDistance(StopId from, StopId to, double distance) {
+        DistancesBetweenStops.Add(from, to, distance);
+        for (const BusId bus_id : Stops[from].BusIds) {
+            const auto& stops = Buses[bus_id].Stops;
+            for (size_t pos = 1; pos < stops.size(); ++pos) {
+                if ((stops[pos - 1] == from && stops[pos] == to) || (stops[pos - 1] == to && stops[pos] == from)) {
+                    RecomputeBusMetrics(bus_id);
+                    Pending.RetimedBuses.push_back(bus_id);
+                    break;
                 }
             }
-            id_after_compress[i] = max_neighbour_id + 1;
         }
-        return id_after_compress;
     }
 
-    void DistributeUniformly(vector<StopInfo>& stops_points, set<string>& pivot_stops) {
-        map<string, pair<double, double>> lat_lon_by_name;
+    vector<int> GetIdsAfterCompress(
+        const vector<StopInfo>& stops_points, 
+        const StopAdjacency& neighbour_stops
+    ) const {
+        vector<StopId> stop_order;
+        stop_order.reserve(stops_points.size());
+        for (const auto& stop : stops_points) {
+            stop_order.push_back(stop.id);
+        }
+        return CompressCoordinates(stop_order, neighbour_stops);
+    }
+
+    void DistributeUniformly(vector<StopInfo>& stops_points, const vector<bool>& pivot_stops) const {
+        vector<pair<double, double>> lat_lon_by_id(Stops.size());
         for (auto& stop : stops_points) {
-            lat_lon_by_name[stop.name] = { stop.lat, stop.lon };
+            lat_lon_by_id[stop.id] = { stop.lat, stop.lon };
         }
 
-        for (auto& [bus_name, bus] : Buses) {
-            auto stops = bus.Stops;
+        for (const BusId bus_id : BusesByName) {
+            const auto& stops = Buses[bus_id].Stops;
             vector<int> pivot_ids;
             for (size_t i = 0; i < stops.size(); ++i) {
-                if (pivot_stops.count(stops[i])) {
+                if (pivot_stops[stops[i]]) {
                     pivot_ids.push_back(i);
                 }
             }
 
             size_t cur_pivot_id = 0;
             for (size_t i = 0; i < stops.size(); ++i) {
-                if (pivot_stops.count(stops[i])) {
+                if (pivot_stops[stops[i]]) {
                     cur_pivot_id++;
                     continue;
                 }
@@ -400,67 +838,76 @@ private:
                 size_t r = pivot_ids[cur_pivot_id];
                 assert(l < i&& i < r);
                 double lat_step = 
-                    (lat_lon_by_name[stops[r]].first - lat_lon_by_name[stops[l]].first) / (r - l);
+                    (lat_lon_by_id[stops[r]].first - lat_lon_by_id[stops[l]].first) / (r - l);
                 double lon_step = 
-                    (lat_lon_by_name[stops[r]].second - lat_lon_by_name[stops[l]].second) / (r - l);
-                lat_lon_by_name[stops[i]] = { 
-                    lat_lon_by_name[stops[l]].first + lat_step * (i - l), 
-                    lat_lon_by_name[stops[l]].second + lon_step * (i - l) 
+                    (lat_lon_by_id[stops[r]].second - lat_lon_by_id[stops[l]].second) / (r - l);
+                lat_lon_by_id[stops[i]] = { 
+                    lat_lon_by_id[stops[l]].first + lat_step * (i - l), 
+                    lat_lon_by_id[stops[l]].second + lon_step * (i - l) 
                 };
             }
         }
 
         for (auto& stop : stops_points) {
-            auto it = lat_lon_by_name.find(stop.name);
-            stop.lat = it->second.first;
-            stop.lon = it->second.second;
+            stop.lat = lat_lon_by_id[stop.id].first;
+            stop.lon = lat_lon_by_id[stop.id].second;
         }
     }
 
-    MapInfo ComputeMapInfo() {
+    MapInfo ComputeMapInfo() const {
         vector<StopInfo> stops_points;
-        for (const auto& [stop_name, stop]: Stops) {
+        for (const StopId stop_id : StopsByName) {
             stops_points.push_back({
-                stop.StopLocation.Latitude, 
-                stop.StopLocation.Longitude, 
-                stop_name
+                Stops[stop_id].StopLocation.Latitude, 
+                Stops[stop_id].StopLocation.Longitude, 
+                stop_id
             });
         }
 
         MapInfo map_info;
+        map_info.StopPoints.resize(Stops.size());
+        map_info.BusColorIdx.resize(Buses.size());
+        for (size_t rank = 0; rank < BusesByName.size(); ++rank) {
+            map_info.BusColorIdx[BusesByName[rank]] =
+                static_cast<uint32_t>(rank % RenderSettings_.color_palette.size());
+        }
 
         // prepare neigbour_stops graph and pivot_stops set
-        set<pair<string, string>> neighbour_stops;
-        set<string> pivot_stops; // endpoints and transfer stops
-        map<string, int> buses_cnt_by_stop_name; 
-        for (auto& [bus_name, bus] : Buses) {
-            pivot_stops.insert(bus.Stops.back());
-            pivot_stops.insert(bus.Stops[0]);
+        StopAdjacency neighbour_stops(Stops.size());
+        vector<bool> pivot_stops(Stops.size(), false); // endpoints and transfer stops
+        vector<int> buses_cnt_by_stop(Stops.size(), 0);
+        vector<int> stops_set(Stops.size(), 0);
+        for (const BusId bus_id : BusesByName) {
+            const auto& bus = Buses[bus_id];
+            pivot_stops[bus.Stops.back()] = true;
+            pivot_stops[bus.Stops[0]] = true;
             if (!bus.IsRoundTrip) {
-                pivot_stops.insert(bus.Stops[bus.Stops.size() / 2]);
+                pivot_stops[bus.Stops[bus.Stops.size() / 2]] = true;
             }
-            map<string, int> stops_set;
-            for (auto& stop : bus.Stops) {
+            for (const StopId stop : bus.Stops) {
                 stops_set[stop]++;
                 if (stops_set[stop] > 2) {
-                    pivot_stops.insert(stop);
+                    pivot_stops[stop] = true;
                 }
                 else if (stops_set[stop] == 1) { // first occurence
-                    buses_cnt_by_stop_name[stop]++;
-                    if (buses_cnt_by_stop_name[stop] >= 2) {
-                        pivot_stops.insert(stop);
+                    buses_cnt_by_stop[stop]++;
+                    if (buses_cnt_by_stop[stop] >= 2) {
+                        pivot_stops[stop] = true;
                     }
                 }
             }
+            for (const StopId stop : bus.Stops) {
+                stops_set[stop] = 0;
+            }
             for (size_t i = 0; i + 1 < bus.Stops.size(); ++i) {
-                neighbour_stops.insert({ bus.Stops[i], bus.Stops[i + 1] });
-                neighbour_stops.insert({ bus.Stops[i + 1], bus.Stops[i] });
+                AddNeighbours(neighbour_stops, bus.Stops[i], bus.Stops[i + 1]);
             }
         }
+        SortNeighbours(neighbour_stops);
 
-        for (auto& [stop_name, stop] : Stops) {
-            if (!buses_cnt_by_stop_name.count(stop_name)) {
-                pivot_stops.insert(stop_name);
+        for (const StopId stop_id : StopsByName) {
+            if (!buses_cnt_by_stop[stop_id]) {
+                pivot_stops[stop_id] = true;
             }
         }
 
@@ -473,11 +920,8 @@ private:
         double step_lon_coor = (RenderSettings_.width - 2 * RenderSettings_.padding) / 
             (max(1, *max_element(id_after_compress.begin(), id_after_compress.end())));
         for (size_t i = 0; i < stops_points.size(); ++i) {
-            map_info[stops_points[i].name] = { 
-                0, 
-                RenderSettings_.padding + step_lon_coor * id_after_compress[i], 
-                stops_points[i].name 
-            };
+            map_info.StopPoints[stops_points[i].id].x =
+                RenderSettings_.padding + step_lon_coor * id_after_compress[i];
         }
         
         // Latitude
@@ -488,42 +932,413 @@ private:
         double step_lat_coor = (RenderSettings_.height - 2 * RenderSettings_.padding) / 
             (max(1, *max_element(id_after_compress.begin(), id_after_compress.end())));
         for (size_t i = 0; i < stops_points.size(); ++i) {
-            map_info[stops_points[i].name].lat = 
+            map_info.StopPoints[stops_points[i].id].y =
                 RenderSettings_.height - RenderSettings_.padding - step_lat_coor * id_after_compress[i];
         }
         return map_info;
     }
 
-    Svg::Document BuildMapSvgDocument(MapInfo& map_info);
-    void AddPolylinesToSvg(MapInfo map_info, Svg::Document& svg_doc);
-    void AddBusesNamesToSvg(MapInfo map_info, Svg::Document& svg_doc);
-    void AddStopCirclesToSvg(MapInfo map_info, Svg::Document& svg_doc);
-    void AddStopNamesToSvg(MapInfo map_info, Svg::Document& svg_doc);
-    void AddOpaqueRectToSvg(Svg::Document& svg_doc);
+    // Figures per task when a layer is rendered on the pool.
+    static const size_t RENDER_CHUNK_SIZE = 2048;
 
-    void AddPathsToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info);
-    void PathAddPolylinesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info);
-    void PathAddBusesNamesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info);
-    void PathAddStopCirclesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info);
-    void PathAddStopNamesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info);
+    template <typename Func>
+    void ParallelFor(size_t count, Func func) const {
+        if (Pool) {
+            Pool->ParallelFor(count, func);
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                func(i);
+            }
+        }
+    }
 
-    struct EdgeInfo {
+    string RenderMapSvg(const MapInfo& map_info) const;
+    void AddLayerToSvg(const string& layer, const MapInfo& map_info, Svg::Document& svg_doc) const;
+    void AddPolylinesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const;
+    void AddBusesNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const;
+    void AddStopCirclesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const;
+    void AddStopNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const;
+    void AddOpaqueRectToSvg(Svg::Document& svg_doc) const;
+
+    // Buses are labelled at their first stop and, unless round, at the turnaround.
+    bool IsBusLabelStop(BusId bus_id, StopId stop_id) const;
+    void AddBusLabelToSvg(const MapInfo& map_info, Svg::Document& svg_doc, BusId bus_id, StopId stop_id) const;
+
+    void AddPathsToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const;
+    void PathAddPolylinesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const;
+    void PathAddBusesNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const;
+    void PathAddStopCirclesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const;
+    void PathAddStopNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const;
+
+    // Edge of the layered graph: getting on a bus, riding it for one span or getting off.
+    struct LayeredEdgeInfo {
+        enum class EType {
+            BOARD,
+            RIDE,
+            ALIGHT
+        } Type;
+        StopId Stop;
+        BusId Bus;
+        // Position of Stop in the bus route.
+        uint32_t Pos;
+    };
+
+    // Travel time of each span of the bus, in minutes.
+    vector<double> ComputeSpanTimes(const Bus& bus) const {
+        vector<double> span_times;
+        span_times.reserve(bus.Stops.size());
+        const double meters_per_minute = BusManagerSettings_.BusVelocity * 1000 / 60.;
+        for (size_t pos = 1; pos < bus.Stops.size(); ++pos) {
+            const double distance = DistancesBetweenStops.Find(bus.Stops[pos - 1], bus.Stops[pos]).value_or(0);
+            span_times.push_back(distance / meters_per_minute);
+        }
+        return span_times;
+    }
+
+    // Candidate for the direct edge between two stops. Ties go to the bus that comes
+    // first by name.
+    struct BestRide {
         double Weight;
-        string StopFrom;
-        string StopTo;
-        string BusName;
-        size_t EdgeId;
+        uint32_t BusRank;
         int SpanCount;
+        uint32_t StartPos;
+
+        bool operator<(const BestRide& other) const {
+            return tie(Weight, BusRank, SpanCount) < tie(other.Weight, other.BusRank, other.SpanCount);
+        }
+    };
+
+    // Calls func(key, ride) for every ride on the bus of the given rank, keyed by packed
+    // (from, to) stop vertices.
+    template <typename Func>
+    void ForEachBusRide(uint32_t bus_rank, Func func) const {
+        const auto& stop_ids = Buses[BusesByName[bus_rank]].Stops;
+        const auto span_times = ComputeSpanTimes(Buses[BusesByName[bus_rank]]);
+
+        for (size_t first_pos = 0; first_pos + 1 < stop_ids.size(); ++first_pos) {
+            double weight = BusManagerSettings_.BusWaitTime;
+            for (size_t second_pos = first_pos + 1; second_pos < stop_ids.size(); ++second_pos) {
+                weight += span_times[second_pos - 1];
+                func(PackedKeyMap<BestRide>::PackKey(VertexByStop[stop_ids[first_pos]], VertexByStop[stop_ids[second_pos]]),
+                    BestRide{ weight, bus_rank, static_cast<int>(second_pos - first_pos),
+                        static_cast<uint32_t>(first_pos) });
+            }
+        }
+    }
+
+    // One edge per ordered pair of stops of every bus, keeping the fastest ride between
+    // each pair of stops. Quadratic in bus length, but routes are short in edges.
+    void BuildDirectGraph() {
+        using namespace Graph;
+
+        size_t pair_count = 0;
+        for (const auto& bus : Buses) {
+            pair_count += bus.Stops.size() * (bus.Stops.size() - 1) / 2;
+        }
+        PackedKeyMap<BestRide> best_ride_by_stops(pair_count);
+
+        for (uint32_t bus_rank = 0; bus_rank < BusesByName.size(); ++bus_rank) {
+            ForEachBusRide(bus_rank, [&best_ride_by_stops](uint64_t key, const BestRide& ride) {
+                auto [best_ride, inserted] = best_ride_by_stops.Insert(key, ride);
+                if (!inserted && ride < *best_ride) {
+                    *best_ride = ride;
+                }
+            });
+        }
+
+        vector<StopId> stop_by_vertex(Stops.size());
+        for (StopId stop_id = 0; stop_id < Stops.size(); ++stop_id) {
+            stop_by_vertex[VertexByStop[stop_id]] = stop_id;
+        }
+        GraphPtr = make_shared<DirectedWeightedGraph<double>>(Stops.size());
+        Edges.reserve(best_ride_by_stops.Size());
+        best_ride_by_stops.ForEach([&](uint64_t key, const BestRide& ride) {
+            const auto [from_vertex, to_vertex] = PackedKeyMap<BestRide>::UnpackKey(key);
+            GraphPtr->AddEdge({ from_vertex, to_vertex, ride.Weight });
+            Edges.push_back({ ride.Weight, stop_by_vertex[from_vertex], stop_by_vertex[to_vertex],
+                BusesByName[ride.BusRank], ride.SpanCount, ride.StartPos });
+        });
+    }
+
+    // Span times of some buses changed but no route did, so every stop pair keeps its
+    // edge. Pairs served by the retimed buses get their best ride chosen again among
+    // all buses through their stops, as BuildDirectGraph() would choose it.
+    void RetimeDirectGraph(const vector<bool>& is_retimed) {
+        PackedKeyMap<BestRide> best_ride_by_stops;
+        vector<bool> is_competitor(Buses.size(), false);
+        for (uint32_t bus_rank = 0; bus_rank < BusesByName.size(); ++bus_rank) {
+            const BusId bus_id = BusesByName[bus_rank];
+            if (!is_retimed[bus_id]) {
+                continue;
+            }
+            ForEachBusRide(bus_rank, [&](uint64_t key, const BestRide& ride) {
+                auto [best_ride, inserted] = best_ride_by_stops.Insert(key, ride);
+                if (!inserted && ride < *best_ride) {
+                    *best_ride = ride;
+                }
+            });
+            for (const StopId stop_id : Buses[bus_id].Stops) {
+                for (const BusId other_id : Stops[stop_id].BusIds) {
+                    is_competitor[other_id] = !is_retimed[other_id];
+                }
+            }
+        }
+        // Other buses can only improve pairs already found above.
+        for (uint32_t bus_rank = 0; bus_rank < BusesByName.size(); ++bus_rank) {
+            if (!is_competitor[BusesByName[bus_rank]]) {
+                continue;
+            }
+            ForEachBusRide(bus_rank, [&](uint64_t key, const BestRide& ride) {
+                BestRide* best_ride = best_ride_by_stops.Find(key);
+                if (best_ride && ride < *best_ride) {
+                    *best_ride = ride;
+                }
+            });
+        }
+
+        for (Graph::EdgeId edge_id = 0; edge_id < Edges.size(); ++edge_id) {
+            auto& edge = Edges[edge_id];
+            const BestRide* ride = best_ride_by_stops.Find(
+                PackedKeyMap<BestRide>::PackKey(VertexByStop[edge.StopFrom], VertexByStop[edge.StopTo]));
+            if (ride) {
+                edge = { ride->Weight, edge.StopFrom, edge.StopTo, BusesByName[ride->BusRank], ride->SpanCount, ride->StartPos };
+                GraphPtr->SetEdgeWeight(edge_id, ride->Weight);
+            }
+        }
+    }
+
+    // Vertices are stops plus one vertex per (bus, position in its route); edges board a
+    // bus (waiting time), ride it for one span and get off (free). The edge count is
+    // linear in total route length.
+    void BuildLayeredGraph() {
+        using namespace Graph;
+
+        size_t vertex_count = Stops.size();
+        for (const auto& bus : Buses) {
+            vertex_count += bus.Stops.size();
+        }
+        GraphPtr = make_shared<DirectedWeightedGraph<double>>(vertex_count);
+
+        VertexId bus_vertex = Stops.size();
+        for (const BusId bus_id : BusesByName) {
+            const auto& bus = Buses[bus_id];
+            const auto span_times = ComputeSpanTimes(bus);
+            for (size_t pos = 0; pos < bus.Stops.size(); ++pos, ++bus_vertex) {
+                const StopId stop_id = bus.Stops[pos];
+                const uint32_t stop_pos = static_cast<uint32_t>(pos);
+                const VertexId stop_vertex = VertexByStop[stop_id];
+                if (pos + 1 < bus.Stops.size()) {
+                    GraphPtr->AddEdge({ stop_vertex, bus_vertex, static_cast<double>(BusManagerSettings_.BusWaitTime) });
+                    LayeredEdges.push_back({ LayeredEdgeInfo::EType::BOARD, stop_id, bus_id, stop_pos });
+                    GraphPtr->AddEdge({ bus_vertex, bus_vertex + 1, span_times[pos] });
+                    LayeredEdges.push_back({ LayeredEdgeInfo::EType::RIDE, stop_id, bus_id, stop_pos });
+                }
+                if (pos > 0) {
+                    GraphPtr->AddEdge({ bus_vertex, stop_vertex, 0 });
+                    LayeredEdges.push_back({ LayeredEdgeInfo::EType::ALIGHT, stop_id, bus_id, stop_pos });
+                }
+            }
+        }
+    }
+
+    // Ride edges of each bus carry its span times, so retiming only rewrites those.
+    void RetimeLayeredGraph(const vector<bool>& is_retimed) {
+        vector<vector<double>> span_times_by_bus(Buses.size());
+        for (Graph::EdgeId edge_id = 0; edge_id < LayeredEdges.size(); ++edge_id) {
+            const auto& edge = LayeredEdges[edge_id];
+            if (edge.Type != LayeredEdgeInfo::EType::RIDE || !is_retimed[edge.Bus]) {
+                continue;
+            }
+            auto& span_times = span_times_by_bus[edge.Bus];
+            if (span_times.empty()) {
+                span_times = ComputeSpanTimes(Buses[edge.Bus]);
+            }
+            GraphPtr->SetEdgeWeight(edge_id, span_times[edge.Pos]);
+        }
+    }
+
+    RouteInfoResponse MakeRouteResponse(double total_time, const vector<EdgeInfo>& rides) const {
+        using Item = RouteInfoResponse::Item;
+
+        RouteInfoResponse::RouteInfo info;
+        info.TotalTime = total_time;
+        info.Items.reserve(rides.size() * 2);
+        for (const auto& ride : rides) {
+            info.Items.push_back({ Item::EType::WAIT, StopNames.GetName(ride.StopFrom),
+                static_cast<double>(BusManagerSettings_.BusWaitTime), 0 });
+            info.Items.push_back({ Item::EType::BUS, BusNames.GetName(ride.Bus),
+                ride.Weight - BusManagerSettings_.BusWaitTime, ride.SpanCount });
+        }
+
+        // The base map is shared; only the route overlay is rendered per query.
+        const auto& map_cache = GetMapCache();
+        Svg::Document svg_doc;
+        AddOpaqueRectToSvg(svg_doc);
+        AddPathsToSvg(map_cache.Layout, svg_doc, rides);
+
+        string overlay;
+        svg_doc.RenderFigures(overlay);
+        Svg::Document::RenderFooter(overlay);
+
+        info.Map = { map_cache.BaseSvg, move(overlay) };
+        return RouteInfoResponse(move(info));
+    }
+
+    // Rides that make up a route found by RouteBuilder.
+    vector<EdgeInfo> GetRouteRides(const Graph::Router<double>::RouteInfo& route_info) const {
+        vector<EdgeInfo> rides;
+        if (BusManagerSettings_.GraphModel != EGraphModel::LAYERED) {
+            rides.reserve(route_info.edges.size());
+            for (const auto edge_id : route_info.edges) {
+                rides.push_back(Edges[edge_id]);
+            }
+            return rides;
+        }
+
+        EdgeInfo ride{};
+        for (const auto edge_id : route_info.edges) {
+            const auto& edge = LayeredEdges[edge_id];
+            switch (edge.Type) {
+                case LayeredEdgeInfo::EType::BOARD:
+                    ride = { GraphPtr->GetEdge(edge_id).weight, edge.Stop, edge.Stop, edge.Bus, 0, edge.Pos };
+                    break;
+                case LayeredEdgeInfo::EType::RIDE:
+                    ride.Weight += GraphPtr->GetEdge(edge_id).weight;
+                    ++ride.SpanCount;
+                    break;
+                case LayeredEdgeInfo::EType::ALIGHT:
+                    ride.StopTo = edge.Stop;
+                    // Boarding and getting off at once only happens with zero waiting time.
+                    if (ride.SpanCount > 0) {
+                        rides.push_back(ride);
+                    }
+                    break;
+            }
+        }
+        return rides;
+    }
+
+    // Every id kept by a loaded manager has to point into the tables it indexes, and
+    // every graph edge has to join the vertices of the ride it stands for, so that
+    // any route the router finds turns into rides within their buses.
+    void CheckLoadedIds() const {
+        using Serialization::Check;
+        Check(BusManagerSettings_.RouterMode == Graph::ERouterMode::ALL_PAIRS
+            || BusManagerSettings_.RouterMode == Graph::ERouterMode::DIJKSTRA
+            || BusManagerSettings_.RouterMode == Graph::ERouterMode::CONTRACTION_HIERARCHY,
+            "Serialized settings have an unknown router mode");
+        Check(BusManagerSettings_.GraphModel == EGraphModel::DIRECT
+            || BusManagerSettings_.GraphModel == EGraphModel::LAYERED,
+            "Serialized settings have an unknown graph model");
+        Check(BusesByName.empty() || !RenderSettings_.color_palette.empty(),
+            "Serialized render settings have no colors");
+
+        for (const auto& stop : Stops) {
+            for (const BusId bus_id : stop.BusIds) {
+                Check(bus_id < Buses.size(), "Serialized stop has a missing bus");
+            }
+        }
+        for (const auto& bus : Buses) {
+            for (const StopId stop_id : bus.Stops) {
+                Check(stop_id < Stops.size(), "Serialized bus has a missing stop");
+            }
+        }
+        for (const StopId stop_id : StopsByName) {
+            Check(stop_id < Stops.size(), "Serialized stop order has a missing stop");
+        }
+        for (const BusId bus_id : BusesByName) {
+            Check(bus_id < Buses.size() && !Buses[bus_id].Stops.empty(), "Serialized bus order has a missing bus");
+        }
+
+        Check(VertexByStop.size() == Stops.size(), "Serialized stop vertices do not match the stops");
+        for (const Graph::VertexId vertex : VertexByStop) {
+            Check(vertex < Stops.size(), "Serialized stop vertices do not match the stops");
+        }
+
+        const auto& graph = *GraphPtr;
+        if (BusManagerSettings_.GraphModel == EGraphModel::DIRECT) {
+            Check(graph.GetVertexCount() == Stops.size() && graph.GetEdgeCount() == Edges.size()
+                && LayeredEdges.empty(), "Serialized rides do not match the graph");
+            for (Graph::EdgeId edge_id = 0; edge_id < Edges.size(); ++edge_id) {
+                const auto& ride = Edges[edge_id];
+                Check(ride.StopFrom < Stops.size() && ride.StopTo < Stops.size() && ride.Bus < Buses.size()
+                    && ride.SpanCount > 0 && ride.StartPos + static_cast<size_t>(ride.SpanCount) < Buses[ride.Bus].Stops.size(),
+                    "Serialized ride is out of its bus route");
+                const auto& edge = graph.GetEdge(edge_id);
+                Check(edge.from == VertexByStop[ride.StopFrom] && edge.to == VertexByStop[ride.StopTo],
+                    "Serialized rides do not match the graph");
+            }
+            return;
+        }
+
+        // Bus vertices are numbered as BuildLayeredGraph() numbers them.
+        size_t vertex_count = Stops.size();
+        for (const auto& bus : Buses) {
+            vertex_count += bus.Stops.size();
+        }
+        Check(graph.GetVertexCount() == vertex_count && graph.GetEdgeCount() == LayeredEdges.size()
+            && Edges.empty(), "Serialized rides do not match the graph");
+        vector<optional<Graph::VertexId>> first_vertex_by_bus(Buses.size());
+        Graph::VertexId bus_vertex = Stops.size();
+        for (const BusId bus_id : BusesByName) {
+            Check(!first_vertex_by_bus[bus_id], "Serialized bus order has a repeated bus");
+            first_vertex_by_bus[bus_id] = bus_vertex;
+            bus_vertex += Buses[bus_id].Stops.size();
+        }
+        for (Graph::EdgeId edge_id = 0; edge_id < LayeredEdges.size(); ++edge_id) {
+            const auto& layered_edge = LayeredEdges[edge_id];
+            Check(layered_edge.Bus < Buses.size() && first_vertex_by_bus[layered_edge.Bus]
+                && layered_edge.Pos < Buses[layered_edge.Bus].Stops.size()
+                && Buses[layered_edge.Bus].Stops[layered_edge.Pos] == layered_edge.Stop,
+                "Serialized ride is out of its bus route");
+            const Graph::VertexId stop_vertex = VertexByStop[layered_edge.Stop];
+            const Graph::VertexId pos_vertex = *first_vertex_by_bus[layered_edge.Bus] + layered_edge.Pos;
+            const auto& edge = graph.GetEdge(edge_id);
+            bool is_matching = false;
+            switch (layered_edge.Type) {
+                case LayeredEdgeInfo::EType::BOARD:
+                    is_matching = edge.from == stop_vertex && edge.to == pos_vertex;
+                    break;
+                case LayeredEdgeInfo::EType::RIDE:
+                    is_matching = layered_edge.Pos + 1 < Buses[layered_edge.Bus].Stops.size()
+                        && edge.from == pos_vertex && edge.to == pos_vertex + 1;
+                    break;
+                case LayeredEdgeInfo::EType::ALIGHT:
+                    is_matching = edge.from == pos_vertex && edge.to == stop_vertex;
+                    break;
+            }
+            Check(is_matching, "Serialized rides do not match the graph");
+        }
+    }
+
+    // What the update methods made stale since the last BuildRoutes().
+    struct PendingUpdates {
+        // Bus routes or the set of stops changed, so the graph is built anew.
+        bool IsRoutingStale = false;
+        // Stops, bus routes or bus names changed, so the map is laid out anew.
+        bool IsLayoutStale = false;
+        // Buses whose span times changed while their routes stayed the same.
+        vector<BusId> RetimedBuses;
     };
 
+    // Graph vertex of each stop, as numbered by the last graph build.
+    vector<Graph::VertexId> VertexByStop;
     vector<EdgeInfo> Edges;
-    unordered_map<string, size_t> StopIdByName;
+    vector<LayeredEdgeInfo> LayeredEdges;
+    PendingUpdates Pending;
     unique_ptr<Graph::Router<double>> RouteBuilder;
+    unique_ptr<MapCache> MapCache_ = make_unique<MapCache>();
+    ThreadPool* Pool = nullptr;
     shared_ptr<Graph::DirectedWeightedGraph<double>> GraphPtr;
 
-    map<string, Stop> Stops;
-    map<string, Bus> Buses;
-    unordered_map<string, unordered_map<string, double>> DistancesBetweenStops;
+    NameTable StopNames;
+    NameTable BusNames;
+    // Indexed by StopId and BusId.
+    vector<Stop> Stops;
+    vector<Bus> Buses;
+    vector<StopId> StopsByName;
+    vector<BusId> BusesByName;
+    RoadDistances DistancesBetweenStops;
     BusManagerSettings BusManagerSettings_;
     RenderSettings RenderSettings_;
 };
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "serialization.h"
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using namespace std;
+
+// Interns names into dense ids 0, 1, 2, ... in order of first appearance, so that the
+// rest of the code can index plain vectors instead of hashing and comparing strings.
+class NameTable {
+public:
+    using Id = uint32_t;
+
+    Id Intern(string_view name) {
+        auto iter = IdByName.find(name);
+        if (iter != IdByName.end()) {
+            return iter->second;
+        }
+        const auto id = static_cast<Id>(Names.size());
+        // deque keeps the stored strings in place, so the views used as keys stay valid
+        const string& stored_name = Names.emplace_back(name);
+        IdByName.emplace(stored_name, id);
+        return id;
+    }
+
+    optional<Id> Find(string_view name) const {
+        auto iter = IdByName.find(name);
+        if (iter == IdByName.end()) {
+            return nullopt;
+        }
+        return iter->second;
+    }
+
+    const string& GetName(Id id) const {
+        return Names[id];
+    }
+
+    size_t Size() const {
+        return Names.size();
+    }
+
+    void Serialize(ostream& out) const {
+        Serialization::Serialize(Names.size(), out);
+        for (const auto& name : Names) {
+            Serialization::Serialize(name, out);
+        }
+    }
+
+    // Ids come back the same because names are interned in id order.
+    void Deserialize(Serialization::Reader& in) {
+        size_t size;
+        Serialization::Deserialize(in, size);
+        string name;
+        for (size_t i = 0; i < size; ++i) {
+            Serialization::Deserialize(in, name);
+            Serialization::Check(Intern(name) == i, "Serialized name table has a repeated name");
+        }
+    }
+
+private:
+    deque<string> Names;
+    unordered_map<string_view, Id> IdByName;
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "serialization.h"
+
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Open-addressing hash map keyed by two 32-bit ids packed into one 64-bit word.
+// Slots live in one flat array and are probed linearly, so a lookup is a hash, one
+// multiplication and usually a single cache line. Entries cannot be erased.
+template <typename Value>
+class PackedKeyMap {
+public:
+    static uint64_t PackKey(uint32_t first, uint32_t second) {
+        return (static_cast<uint64_t>(first) << 32) | second;
+    }
+
+    static std::pair<uint32_t, uint32_t> UnpackKey(uint64_t key) {
+        return { static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key) };
+    }
+
+    PackedKeyMap() = default;
+
+    explicit PackedKeyMap(size_t expected_size) {
+        Reserve(expected_size);
+    }
+
+    void Reserve(size_t expected_size) {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity * MAX_LOAD_NUMERATOR < expected_size * MAX_LOAD_DENOMINATOR) {
+            capacity *= 2;
+        }
+        if (capacity > slots_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    // Returns the value slot and whether it was created by this call.
+    std::pair<Value*, bool> Insert(uint64_t key, const Value& value) {
+        if ((size_ + 1) * MAX_LOAD_DENOMINATOR > slots_.size() * MAX_LOAD_NUMERATOR) {
+            Rehash(slots_.empty() ? MIN_CAPACITY : slots_.size() * 2);
+        }
+        Slot& slot = slots_[FindSlotIndex(key)];
+        if (slot.key == key) {
+            return { &slot.value, false };
+        }
+        slot.key = key;
+        slot.value = value;
+        ++size_;
+        return { &slot.value, true };
+    }
+
+    Value& operator[](uint64_t key) {
+        return *Insert(key, Value{}).first;
+    }
+
+    const Value* Find(uint64_t key) const {
+        if (slots_.empty()) {
+            return nullptr;
+        }
+        const Slot& slot = slots_[FindSlotIndex(key)];
+        return slot.key == key ? &slot.value : nullptr;
+    }
+
+    Value* Find(uint64_t key) {
+        if (slots_.empty()) {
+            return nullptr;
+        }
+        Slot& slot = slots_[FindSlotIndex(key)];
+        return slot.key == key ? &slot.value : nullptr;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Bytes taken by the slot array.
+    size_t GetMemoryUsage() const {
+        return slots_.capacity() * sizeof(Slot);
+    }
+
+    // Calls func(key, value) for every entry, in slot order.
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (const Slot& slot : slots_) {
+            if (slot.key != EMPTY_KEY) {
+                func(slot.key, slot.value);
+            }
+        }
+    }
+
+    // The slot array is written as is, so loading needs no rehashing.
+    void Serialize(std::ostream& out) const {
+        Serialization::Serialize(slots_, out);
+        Serialization::Serialize(size_, out);
+    }
+
+    // Probing relies on a power-of-two capacity and on at least one empty slot, so a
+    // corrupt table is rejected here rather than read out of bounds or probed forever.
+    // A map that never had an entry has no slots at all and is never probed.
+    void Deserialize(Serialization::Reader& in) {
+        Serialization::Deserialize(in, slots_);
+        Serialization::Deserialize(in, size_);
+        if (slots_.empty()) {
+            if (size_ != 0) {
+                throw std::runtime_error("Serialized hash table has entries but no slots");
+            }
+            return;
+        }
+        if (slots_.size() & (slots_.size() - 1)) {
+            throw std::runtime_error("Serialized hash table has a bad capacity");
+        }
+        size_t used_count = 0;
+        for (const Slot& slot : slots_) {
+            used_count += slot.key != EMPTY_KEY;
+        }
+        if (used_count != size_ || size_ >= slots_.size()) {
+            throw std::runtime_error("Serialized hash table has a bad size");
+        }
+    }
+
+private:
+    // Never produced by PackKey for real ids: both halves would have to be 2^32 - 1.
+    static constexpr uint64_t EMPTY_KEY = ~uint64_t(0);
+    static constexpr size_t MIN_CAPACITY = 16;
+    static constexpr size_t MAX_LOAD_NUMERATOR = 7;
+    static constexpr size_t MAX_LOAD_DENOMINATOR = 10;
+
+    struct Slot {
+        uint64_t key = EMPTY_KEY;
+        Value value{};
+    };
+
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+
+    static size_t Hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return static_cast<size_t>(key);
+    }
+
+    // Slot holding the key, or the empty slot where it would be inserted.
+    size_t FindSlotIndex(uint64_t key) const {
+        const size_t mask = slots_.size() - 1;
+        size_t idx = Hash(key) & mask;
+        while (slots_[idx].key != key && slots_[idx].key != EMPTY_KEY) {
+            idx = (idx + 1) & mask;
+        }
+        return idx;
+    }
+
+    void Rehash(size_t capacity) {
+        std::vector<Slot> old_slots(capacity);
+        old_slots.swap(slots_);
+        for (Slot& slot : old_slots) {
+            if (slot.key != EMPTY_KEY) {
+                slots_[FindSlotIndex(slot.key)] = std::move(slot);
+            }
+        }
+    }
+};
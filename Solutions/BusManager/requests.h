@@ -24,6 +24,10 @@ public:
     enum class ERequestType {
         ADD_STOP,
         ADD_BUS,
+        UPDATE_STOP,
+        UPDATE_BUS,
+        REMOVE_STOP,
+        REMOVE_BUS,
         QUERY_BUS,
         QUERY_STOP,
         QUERY_ROUTE,
@@ -35,7 +39,7 @@ public:
     {}
 
     virtual void ReadInfo(istream&) = 0;
-    virtual void ReadInfo(const Node&) = 0;
+    virtual void ReadInfo(const Element&) = 0;
     virtual ~Request() = default;
 };
 
@@ -81,18 +85,20 @@ public:
 		}
 	}
 
-	void ReadInfo(const Node& node) override {
+	void ReadInfo(const Element& node) override {
 		const auto& node_map = node.AsMap();
 		StopLocation = { node_map.at("latitude").AsDouble(), node_map.at("longitude").AsDouble() };
 		Name = node_map.at("name").AsString();
 		if (node_map.count("road_distances")) {
 			for (const auto& [stop_name, dist] : node_map.at("road_distances").AsMap()) {
-				DistsToStops[stop_name] = dist.AsDouble();
+				DistsToStops[string(stop_name)] = dist.AsDouble();
 			}
 		}
 	}
 
-private:
+protected:
+	explicit AddStopRequest(Request::ERequestType type) : ModifyRequest(type) {}
+
 	Location StopLocation;
 	string Name;
 	unordered_map<string, double> DistsToStops;
@@ -120,12 +126,12 @@ public:
         }
     }
 
-    void ReadInfo(const Node& node) override {
+    void ReadInfo(const Element& node) override {
         const auto& node_map = node.AsMap();
         Name = node_map.at("name").AsString();
         const auto& stop_nodes = node_map.at("stops").AsArray();
         for (const auto& stop_node : stop_nodes) {
-            BusStopNames.push_back(stop_node.AsString());
+            BusStopNames.emplace_back(stop_node.AsString());
         }
         IsRoundTrip = true;
         if (node_map.at("is_roundtrip").AsDouble() < 0.5) { // false
@@ -138,18 +144,80 @@ public:
         }
     }
 
-private:
+protected:
+    explicit AddBusRequest(Request::ERequestType type) : ModifyRequest(type) {}
+
     vector<string> BusStopNames;
     string Name;
     bool IsRoundTrip;
 };
 
+// Changes to a built database, sent to a running server. UpdateStop and UpdateBus take
+// the same fields as the base requests and add or replace the stop or bus.
+class UpdateStopRequest : public AddStopRequest {
+public:
+    UpdateStopRequest() : AddStopRequest(Request::ERequestType::UPDATE_STOP) {}
+
+    void Process(BusManager& manager) const override {
+        manager.UpdateStop(Name, StopLocation, DistsToStops);
+    }
+};
+
+class UpdateBusRequest : public AddBusRequest {
+public:
+    UpdateBusRequest() : AddBusRequest(Request::ERequestType::UPDATE_BUS) {}
+
+    void Process(BusManager& manager) const override {
+        manager.UpdateBus(Name, BusStopNames, IsRoundTrip);
+    }
+};
+
+class RemoveStopRequest : public ModifyRequest {
+public:
+    RemoveStopRequest() : ModifyRequest(Request::ERequestType::REMOVE_STOP) {}
+
+    void Process(BusManager& manager) const override {
+        manager.RemoveStop(Name);
+    }
+
+    void ReadInfo(istream& is) override {
+        throw runtime_error("Not implemented");
+    }
+
+    void ReadInfo(const Element& node) override {
+        Name = node.AsMap().at("name").AsString();
+    }
+
+private:
+    string Name;
+};
+
+class RemoveBusRequest : public ModifyRequest {
+public:
+    RemoveBusRequest() : ModifyRequest(Request::ERequestType::REMOVE_BUS) {}
+
+    void Process(BusManager& manager) const override {
+        manager.RemoveBus(Name);
+    }
+
+    void ReadInfo(istream& is) override {
+        throw runtime_error("Not implemented");
+    }
+
+    void ReadInfo(const Element& node) override {
+        Name = node.AsMap().at("name").AsString();
+    }
+
+private:
+    string Name;
+};
+
 template <typename ResultType>
 class ReadRequest : public Request {
 public:
     virtual ~ReadRequest() = default;
     using Request::Request;
-	virtual ResultType Process(BusManager& manager) const = 0;
+	virtual ResultType Process(const BusManager& manager) const = 0;
 
 protected:
 	int32_t Request_id = -1;
@@ -160,9 +228,8 @@ public:
     ~ReadMapInfoRequest() = default;
     ReadMapInfoRequest() : ReadRequest(Request::ERequestType::QUERY_MAP) {}
     
-    MapInfoResponse Process(BusManager& manager) const override {
+    MapInfoResponse Process(const BusManager& manager) const override {
         auto response = manager.GetMapInfoResponse();
-        response.Info.AddNodeToMap("request_id", Node(static_cast<double>(Request_id)));
         response.SetRequestId(Request_id);
         return response;
     }
@@ -171,7 +238,7 @@ public:
         throw runtime_error("not implemented");
     }
 
-    void ReadInfo(const Node& node) override {
+    void ReadInfo(const Element& node) override {
         Request_id = static_cast<int>(node.AsMap().at("id").AsDouble());
     }
 };
@@ -181,7 +248,7 @@ public:
     ~ReadBusInfoRequest() = default; 
     ReadBusInfoRequest() : ReadRequest(Request::ERequestType::QUERY_BUS) {}
 
-    BusInfoResponse Process(BusManager& manager) const override {
+    BusInfoResponse Process(const BusManager& manager) const override {
         auto response = manager.GetBusInfoResponse(BusName);
         response.SetRequestId(Request_id);
         return response;
@@ -195,7 +262,7 @@ public:
         BusName = info[0];
     }
 
-    void ReadInfo(const Node& node) override {
+    void ReadInfo(const Element& node) override {
         BusName = node.AsMap().at("name").AsString();
         Request_id = static_cast<int>(node.AsMap().at("id").AsDouble());
     }
@@ -209,7 +276,7 @@ public:
         virtual ~ReadStopInfoRequest() = default;
 	ReadStopInfoRequest() : ReadRequest(Request::ERequestType::QUERY_STOP) {}
 
-	StopInfoResponse Process(BusManager& manager) const override {
+	StopInfoResponse Process(const BusManager& manager) const override {
 		auto response = manager.GetStopInfoResponse(StopName);
 		response.SetRequestId(Request_id);
 		return response;
@@ -223,7 +290,7 @@ public:
 		StopName = info[0];
 	}
 
-	void ReadInfo(const Node& node) override {
+	void ReadInfo(const Element& node) override {
 		StopName = node.AsMap().at("name").AsString();
 		Request_id = static_cast<int>(node.AsMap().at("id").AsDouble());
 	}
@@ -237,19 +304,37 @@ public:
     virtual ~ReadRouteInfoRequest() = default;
     ReadRouteInfoRequest() : ReadRequest(Request::ERequestType::QUERY_ROUTE) {}
 
-    RouteInfoResponse Process(BusManager& manager) const override {
+    RouteInfoResponse Process(const BusManager& manager) const override {
         auto response = manager.GetRouteResponse(StopFrom, StopTo);
-        //auto response = manager.GetMapInfoResponse();
-        response.Info.AddNodeToMap("request_id", Node(static_cast<double>(Request_id)));
         response.SetRequestId(Request_id);
         return response;
     }
 
+    // Answers requests that all start at the same stop with a single manager call, which
+    // shares one route search between them.
+    static vector<RouteInfoResponse> ProcessFromCommonStop(const vector<const ReadRouteInfoRequest*>& requests,
+        const BusManager& manager) {
+        vector<string> stops_to;
+        stops_to.reserve(requests.size());
+        for (const auto* request : requests) {
+            stops_to.push_back(request->StopTo);
+        }
+        auto responses = manager.GetRouteResponses(requests[0]->StopFrom, stops_to);
+        for (size_t i = 0; i < requests.size(); ++i) {
+            responses[i].SetRequestId(requests[i]->Request_id);
+        }
+        return responses;
+    }
+
+    const string& GetStopFrom() const {
+        return StopFrom;
+    }
+
     void ReadInfo(istream& is) override {
         throw runtime_error("Not implemented");
     }
 
-    void ReadInfo(const Node& node) override {
+    void ReadInfo(const Element& node) override {
         StopFrom = node.AsMap().at("from").AsString();
         StopTo = node.AsMap().at("to").AsString();
         Request_id = static_cast<int>(node.AsMap().at("id").AsDouble());
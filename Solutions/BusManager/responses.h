@@ -33,6 +33,7 @@ public:
     Response(EResponseType&& type)
         : Type(type)
     {}
+    virtual ~Response() = default;
 
     void SetRequestId(int32_t id) {
         Request_id = id;
@@ -41,28 +42,52 @@ public:
     int32_t Request_id = -1;
 };
 
+// SVG of a response: the base map shared by all responses followed by what was drawn
+// for this one. Printed as a single JSON string, escaped on the way out.
+struct MapSvg {
+    shared_ptr<const string> Base;
+    string Overlay;
+};
+
 class RouteInfoResponse : public Response {
 public:
     RouteInfoResponse() : Response(Response::EResponseType::ROUTE_INFO) {}
 
-    RouteInfoResponse(Json::Node&& node)
+    // Waiting at StopName, or riding bus Name for SpanCount stops.
+    struct Item {
+        enum class EType {
+            WAIT,
+            BUS
+        } Type;
+        string Name;
+        double Time;
+        int SpanCount;
+    };
+
+    struct RouteInfo {
+        double TotalTime;
+        vector<Item> Items;
+        MapSvg Map;
+    };
+
+    RouteInfoResponse(optional<RouteInfo>&& info)
         : Response(Response::EResponseType::ROUTE_INFO)
-        , Info(node)
+        , Info(move(info))
     {}
 
-    Json::Node Info;
+    optional<RouteInfo> Info;
 };
 
 class MapInfoResponse : public Response {
 public:
     MapInfoResponse() : Response(Response::EResponseType::MAP_INFO) {}
     
-    MapInfoResponse(Json::Node&& node)
+    MapInfoResponse(MapSvg&& map)
         : Response(Response::EResponseType::MAP_INFO)
-        , Info(node)
+        , Map(move(map))
     {}
 
-    Json::Node Info;
+    MapSvg Map;
 };
 
 class BusInfoResponse: public Response {
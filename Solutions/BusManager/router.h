@@ -1,40 +1,78 @@
 #pragma once
 
+#include "contraction_hierarchy.h"
 #include "graph.h"
+#include "search_scratch.h"
+#include "serialization.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <iterator>
+#include <memory>
 #include <optional>
-#include <unordered_map>
+#include <ostream>
 #include <utility>
 #include <vector>
 
 namespace Graph {
 
+    // ALL_PAIRS precomputes every route in O(V^3) time and O(V^2) memory and answers
+    // queries by table lookup. DIJKSTRA precomputes nothing and runs a binary-heap
+    // search per query, so it is the only option for large graphs.
+    // CONTRACTION_HIERARCHY spends some preprocessing on shortcuts to make queries on
+    // large graphs explore only a small part of them.
+    // All modes find routes of the same weight. When several routes are equally short,
+    // each mode may return a different one.
+    enum class ERouterMode {
+        ALL_PAIRS,
+        DIJKSTRA,
+        CONTRACTION_HIERARCHY
+    };
+
     template <typename Weight>
     class Router {
     private:
         using Graph = DirectedWeightedGraph<Weight>;
 
     public:
-        Router(const Graph& graph);
+        Router(const Graph& graph, ERouterMode mode = ERouterMode::ALL_PAIRS);
+        // Restores precomputed data written by Serialize() for the same graph.
+        Router(const Graph& graph, Serialization::Reader& in);
 
-        using RouteId = uint64_t;
+        void Serialize(std::ostream& out) const;
 
         struct RouteInfo {
-            RouteId id;
             Weight weight;
-            size_t edge_count;
+            // Points into the buffer the route was written to and stays valid until
+            // the next query that writes into the same buffer.
+            Range<const EdgeId*> edges;
         };
 
+        // Writes the route edges into a buffer owned by the calling thread and reused by
+        // every query made from it, so answering a query allocates nothing.
         std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const;
-        EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
-        void ReleaseRoute(RouteId route_id);
+        // Same, but writes into the given buffer, reusing its capacity.
+        std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+
+        // Routes from one vertex to each of the targets: on_route(i, route) gets the route
+        // to targets[i], whose edges are valid only during the call. DIJKSTRA finds them
+        // all with one search that stops once every target is settled; the other modes
+        // answer target by target, as their queries are cheap already.
+        template <typename Func>
+        void BuildRoutesFrom(VertexId from, const std::vector<VertexId>& targets, Func on_route) const;
+
+        ERouterMode GetMode() const {
+            return mode_;
+        }
+
+        // Bytes taken by the precomputed data of the current mode.
+        size_t GetIndexSize() const;
 
     private:
         const Graph& graph_;
+        ERouterMode mode_;
+        std::unique_ptr<ContractionHierarchy<Weight>> hierarchy_;
 
         struct RouteInternalData {
             Weight weight;
@@ -42,10 +80,6 @@ namespace Graph {
         };
         using RoutesInternalData = std::vector<std::vector<std::optional<RouteInternalData>>>;
 
-        using ExpandedRoute = std::vector<EdgeId>;
-        mutable RouteId next_route_id_ = 0;
-        mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
-
         void InitializeRoutesInternalData(const Graph& graph) {
             const size_t vertex_count = graph.GetVertexCount();
             for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
@@ -88,14 +122,42 @@ namespace Graph {
         }
 
         RoutesInternalData routes_internal_data_;
+
+        static SearchScratch<Weight>& GetSearchScratch() {
+            thread_local SearchScratch<Weight> scratch;
+            return scratch;
+        }
+
+        static std::vector<EdgeId>& GetRouteBuffer() {
+            thread_local std::vector<EdgeId> buffer;
+            return buffer;
+        }
+
+        // Settles vertices in order of weight until is_last(vertex) holds for a settled one
+        // or nothing reachable is left, so every vertex reached by then is settled.
+        template <typename IsLast>
+        void RunDijkstra(VertexId from, SearchScratch<Weight>& scratch, IsLast is_last) const;
+        void TraceRoute(VertexId to, const SearchScratch<Weight>& scratch, std::vector<EdgeId>& edges) const;
+        std::optional<Weight> BuildRouteAllPairs(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+        std::optional<Weight> BuildRouteDijkstra(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+        void CheckRoutesInternalData() const;
     };
 
 
     template <typename Weight>
-    Router<Weight>::Router(const Graph& graph)
+    Router<Weight>::Router(const Graph& graph, ERouterMode mode)
         : graph_(graph),
-        routes_internal_data_(graph.GetVertexCount(), std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()))
+        mode_(mode)
     {
+        if (mode_ == ERouterMode::CONTRACTION_HIERARCHY) {
+            hierarchy_ = std::make_unique<ContractionHierarchy<Weight>>(graph);
+        }
+        if (mode_ != ERouterMode::ALL_PAIRS) {
+            return;
+        }
+
+        routes_internal_data_.assign(graph.GetVertexCount(),
+            std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()));
         InitializeRoutesInternalData(graph);
 
         const size_t vertex_count = graph.GetVertexCount();
@@ -104,14 +166,123 @@ namespace Graph {
         }
     }
 
+    template <typename Weight>
+    Router<Weight>::Router(const Graph& graph, Serialization::Reader& in)
+        : graph_(graph)
+    {
+        using Serialization::Check;
+        using Serialization::Deserialize;
+        Deserialize(in, mode_);
+        Check(mode_ == ERouterMode::ALL_PAIRS || mode_ == ERouterMode::DIJKSTRA
+            || mode_ == ERouterMode::CONTRACTION_HIERARCHY, "Serialized router has an unknown mode");
+        if (mode_ == ERouterMode::CONTRACTION_HIERARCHY) {
+            hierarchy_ = std::make_unique<ContractionHierarchy<Weight>>(in);
+            Check(hierarchy_->GetVertexCount() == graph.GetVertexCount()
+                && hierarchy_->GetOriginalEdgeCount() == graph.GetEdgeCount(),
+                "Serialized hierarchy does not match the graph");
+        }
+        Deserialize(in, routes_internal_data_);
+        if (mode_ == ERouterMode::ALL_PAIRS) {
+            CheckRoutesInternalData();
+        } else {
+            Check(routes_internal_data_.empty(), "Serialized router has routes it does not use");
+        }
+    }
+
+    // Every route has to lead back to its start through entries that exist, or tracing
+    // it would read a missing entry or never end. Takes O(V^2), like the table itself.
+    template <typename Weight>
+    void Router<Weight>::CheckRoutesInternalData() const {
+        using Serialization::Check;
+        const size_t vertex_count = graph_.GetVertexCount();
+        Check(routes_internal_data_.size() == vertex_count, "Serialized routes do not match the graph");
+        // 1 while on the chain being followed, 2 once known to lead back to the start.
+        std::vector<uint8_t> states(vertex_count);
+        std::vector<VertexId> chain;
+        for (VertexId from = 0; from < vertex_count; ++from) {
+            const auto& routes = routes_internal_data_[from];
+            Check(routes.size() == vertex_count, "Serialized routes do not match the graph");
+            std::fill(states.begin(), states.end(), 0);
+            for (VertexId to = 0; to < vertex_count; ++to) {
+                chain.clear();
+                for (VertexId vertex = to; routes[vertex] && states[vertex] != 2;) {
+                    Check(states[vertex] == 0, "Serialized routes have a cycle");
+                    states[vertex] = 1;
+                    chain.push_back(vertex);
+                    const auto& prev_edge = routes[vertex]->prev_edge;
+                    if (!prev_edge) {
+                        Check(vertex == from, "Serialized routes have a broken route");
+                        break;
+                    }
+                    Check(*prev_edge < graph_.GetEdgeCount() && graph_.GetEdge(*prev_edge).to == vertex,
+                        "Serialized routes have a broken route");
+                    vertex = graph_.GetEdge(*prev_edge).from;
+                    Check(routes[vertex].has_value(), "Serialized routes have a broken route");
+                }
+                for (const VertexId vertex : chain) {
+                    states[vertex] = 2;
+                }
+            }
+        }
+    }
+
+    template <typename Weight>
+    void Router<Weight>::Serialize(std::ostream& out) const {
+        using Serialization::Serialize;
+        Serialize(mode_, out);
+        if (hierarchy_) {
+            hierarchy_->Serialize(out);
+        }
+        Serialize(routes_internal_data_, out);
+    }
+
     template <typename Weight>
     std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
+        return BuildRoute(from, to, GetRouteBuffer());
+    }
+
+    template <typename Weight>
+    std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to,
+        std::vector<EdgeId>& edges) const {
+        edges.clear();
+        std::optional<Weight> weight;
+        switch (mode_) {
+            case ERouterMode::DIJKSTRA:
+                weight = BuildRouteDijkstra(from, to, edges);
+                break;
+            case ERouterMode::CONTRACTION_HIERARCHY:
+                weight = hierarchy_->FindRoute(from, to, edges);
+                break;
+            default:
+                weight = BuildRouteAllPairs(from, to, edges);
+                break;
+        }
+        if (!weight) {
+            return std::nullopt;
+        }
+        return RouteInfo{ *weight, Range<const EdgeId*>(edges.data(), edges.data() + edges.size()) };
+    }
+
+    template <typename Weight>
+    size_t Router<Weight>::GetIndexSize() const {
+        switch (mode_) {
+            case ERouterMode::ALL_PAIRS:
+                return routes_internal_data_.size() * routes_internal_data_.size()
+                    * sizeof(std::optional<RouteInternalData>);
+            case ERouterMode::CONTRACTION_HIERARCHY:
+                return hierarchy_->GetIndexSize();
+            default:
+                return 0;
+        }
+    }
+
+    template <typename Weight>
+    std::optional<Weight> Router<Weight>::BuildRouteAllPairs(VertexId from, VertexId to,
+        std::vector<EdgeId>& edges) const {
         const auto& route_internal_data = routes_internal_data_[from][to];
         if (!route_internal_data) {
             return std::nullopt;
         }
-        const Weight weight = route_internal_data->weight;
-        std::vector<EdgeId> edges;
         for (std::optional<EdgeId> edge_id = route_internal_data->prev_edge;
             edge_id;
             edge_id = routes_internal_data_[from][graph_.GetEdge(*edge_id).from]->prev_edge) {
@@ -119,20 +290,87 @@ namespace Graph {
         }
         std::reverse(std::begin(edges), std::end(edges));
 
-        const RouteId route_id = next_route_id_++;
-        const size_t route_edge_count = edges.size();
-        expanded_routes_cache_[route_id] = std::move(edges);
-        return RouteInfo{ route_id, weight, route_edge_count };
+        return route_internal_data->weight;
     }
 
     template <typename Weight>
-    EdgeId Router<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
-        return expanded_routes_cache_.at(route_id)[edge_idx];
+    template <typename IsLast>
+    void Router<Weight>::RunDijkstra(VertexId from, SearchScratch<Weight>& scratch, IsLast is_last) const {
+        scratch.Reset(graph_.GetVertexCount());
+        scratch.Reach(from, 0, NO_EDGE);
+        scratch.Push(0, from);
+
+        typename SearchScratch<Weight>::QueueItem item;
+        while (scratch.PopSettled(item)) {
+            const auto [weight, vertex] = item;
+            if (is_last(vertex)) {
+                return;
+            }
+            graph_.ForEachIncidentEdge(vertex, [&scratch, weight = weight](EdgeId edge_id, VertexId edge_to, Weight edge_weight) {
+                assert(edge_weight >= 0);
+                scratch.Relax(edge_to, weight + edge_weight, edge_id);
+            });
+        }
     }
 
     template <typename Weight>
-    void Router<Weight>::ReleaseRoute(RouteId route_id) {
-        expanded_routes_cache_.erase(route_id);
+    void Router<Weight>::TraceRoute(VertexId to, const SearchScratch<Weight>& scratch,
+        std::vector<EdgeId>& edges) const {
+        for (EdgeId edge_id = scratch.prev_edges[to]; edge_id != NO_EDGE;
+            edge_id = scratch.prev_edges[graph_.GetEdge(edge_id).from]) {
+            edges.push_back(edge_id);
+        }
+        std::reverse(std::begin(edges), std::end(edges));
+    }
+
+    template <typename Weight>
+    std::optional<Weight> Router<Weight>::BuildRouteDijkstra(VertexId from, VertexId to,
+        std::vector<EdgeId>& edges) const {
+        auto& scratch = GetSearchScratch();
+        RunDijkstra(from, scratch, [to](VertexId vertex) { return vertex == to; });
+        if (!scratch.IsReached(to)) {
+            return std::nullopt;
+        }
+        TraceRoute(to, scratch, edges);
+        return scratch.weights[to];
+    }
+
+    // Up to the moment a target is settled the search does exactly what a query for
+    // that target alone would, so each target gets the same route as from BuildRoute().
+    template <typename Weight>
+    template <typename Func>
+    void Router<Weight>::BuildRoutesFrom(VertexId from, const std::vector<VertexId>& targets, Func on_route) const {
+        if (targets.empty()) {
+            return;
+        }
+        if (mode_ != ERouterMode::DIJKSTRA) {
+            for (size_t i = 0; i < targets.size(); ++i) {
+                on_route(i, BuildRoute(from, targets[i]));
+            }
+            return;
+        }
+
+        std::vector<VertexId> pending = targets;
+        std::sort(pending.begin(), pending.end());
+        pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+        size_t pending_count = pending.size();
+        auto& scratch = GetSearchScratch();
+        RunDijkstra(from, scratch, [&](VertexId vertex) {
+            return std::binary_search(pending.begin(), pending.end(), vertex) && --pending_count == 0;
+        });
+
+        auto& edges = GetRouteBuffer();
+        for (size_t i = 0; i < targets.size(); ++i) {
+            const VertexId to = targets[i];
+            if (!scratch.IsReached(to)) {
+                on_route(i, std::optional<RouteInfo>());
+                continue;
+            }
+            edges.clear();
+            TraceRoute(to, scratch, edges);
+            on_route(i, std::optional<RouteInfo>(RouteInfo{
+                scratch.weights[to], Range<const EdgeId*>(edges.data(), edges.data() + edges.size()) }));
+        }
     }
 
-}
+}
\ No newline at end of file
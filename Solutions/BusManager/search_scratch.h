@@ -0,0 +1,84 @@
+#pragma once
+
+#include "graph.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    constexpr EdgeId NO_EDGE = std::numeric_limits<EdgeId>::max();
+
+    // Dijkstra state reused between searches. Vertices are reset lazily: a vertex
+    // whose stamp differs from the current epoch has not been reached yet.
+    template <typename Weight>
+    struct SearchScratch {
+        using QueueItem = std::pair<Weight, VertexId>;
+
+        std::vector<Weight> weights;
+        std::vector<EdgeId> prev_edges;
+        std::vector<uint32_t> stamps;
+        uint32_t epoch = 0;
+        std::vector<QueueItem> heap;
+
+        void Reset(size_t vertex_count) {
+            if (stamps.size() < vertex_count) {
+                weights.resize(vertex_count);
+                prev_edges.resize(vertex_count);
+                stamps.resize(vertex_count, 0);
+            }
+            if (++epoch == 0) {
+                std::fill(stamps.begin(), stamps.end(), 0);
+                epoch = 1;
+            }
+            heap.clear();
+        }
+
+        bool IsReached(VertexId vertex) const {
+            return stamps[vertex] == epoch;
+        }
+
+        void Reach(VertexId vertex, Weight weight, EdgeId prev_edge) {
+            stamps[vertex] = epoch;
+            weights[vertex] = weight;
+            prev_edges[vertex] = prev_edge;
+        }
+
+        // Records the weight if it improves on the current one and queues the vertex.
+        bool Relax(VertexId vertex, Weight weight, EdgeId prev_edge) {
+            if (IsReached(vertex) && !(weight < weights[vertex])) {
+                return false;
+            }
+            Reach(vertex, weight, prev_edge);
+            Push(weight, vertex);
+            return true;
+        }
+
+        void Push(Weight weight, VertexId vertex) {
+            heap.push_back({ weight, vertex });
+            std::push_heap(heap.begin(), heap.end(), std::greater<QueueItem>());
+        }
+
+        const QueueItem& Top() const {
+            return heap.front();
+        }
+
+        // Pops queue items until one is up to date; returns false when the queue runs out.
+        bool PopSettled(QueueItem& item) {
+            while (!heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), std::greater<QueueItem>());
+                item = heap.back();
+                heap.pop_back();
+                if (!(weights[item.second] < item.first)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+}
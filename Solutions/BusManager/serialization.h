@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Raw binary snapshots in the spirit of SaveAndLoad: trivially copyable values are
+// written byte for byte, containers as their size followed by the elements, and
+// vectors of trivially copyable values in one piece. Reading goes through a bounds
+// checked cursor over a memory buffer, usually a mapped file.
+namespace Serialization {
+
+    class Reader {
+    public:
+        Reader(const char* data, size_t size)
+            : pos_(data)
+            , end_(data + size)
+        {}
+
+        void Read(void* dst, size_t size) {
+            if (size > Remaining()) {
+                throw std::runtime_error("Serialized data is truncated");
+            }
+            // An empty vector may have no buffer to copy into.
+            if (size > 0) {
+                std::memcpy(dst, pos_, size);
+            }
+            pos_ += size;
+        }
+
+        size_t Remaining() const {
+            return end_ - pos_;
+        }
+
+    private:
+        const char* pos_;
+        const char* end_;
+    };
+
+    // Whole file contents, memory-mapped where the platform allows it.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* Data() const {
+            return data_;
+        }
+
+        size_t Size() const {
+            return size_;
+        }
+
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+        std::string buffer_;
+        bool mapped_ = false;
+    };
+
+    template <typename T>
+    using EnableIfPod = std::enable_if_t<std::is_trivially_copyable_v<T>, int>;
+
+    template <typename T, EnableIfPod<T> = 0>
+    void Serialize(const T& pod, std::ostream& out);
+
+    void Serialize(const std::string& str, std::ostream& out);
+
+    template <typename T>
+    void Serialize(const std::vector<T>& data, std::ostream& out);
+
+    template <typename T, EnableIfPod<T> = 0>
+    void Deserialize(Reader& in, T& pod);
+
+    void Deserialize(Reader& in, bool& flag);
+
+    void Deserialize(Reader& in, std::string& str);
+
+    template <typename T>
+    void Deserialize(Reader& in, std::vector<T>& data);
+
+
+    // Serialization
+
+    template <typename T, EnableIfPod<T>>
+    void Serialize(const T& pod, std::ostream& out) {
+        out.write(reinterpret_cast<const char*>(&pod), sizeof(pod));
+    }
+
+    inline void Serialize(const std::string& str, std::ostream& out) {
+        Serialize(str.size(), out);
+        out.write(str.data(), str.size());
+    }
+
+    template <typename T>
+    void Serialize(const std::vector<T>& data, std::ostream& out) {
+        Serialize(data.size(), out);
+        if constexpr (std::is_trivially_copyable_v<T>) {
+            out.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(T));
+        } else {
+            for (const auto& element : data) {
+                Serialize(element, out);
+            }
+        }
+    }
+
+
+    // Deserialization
+
+    // Loaders check every id and offset they keep, so that a corrupt snapshot is
+    // rejected while loading instead of sending a query out of bounds later.
+    inline void Check(bool condition, const char* message) {
+        if (!condition) {
+            throw std::runtime_error(message);
+        }
+    }
+
+    inline size_t DeserializeSize(Reader& in, size_t min_element_size) {
+        size_t size;
+        Deserialize(in, size);
+        // Checked before anything is allocated for a corrupted size.
+        if (min_element_size > 0 && size > in.Remaining() / min_element_size) {
+            throw std::runtime_error("Serialized data is truncated");
+        }
+        return size;
+    }
+
+    template <typename T, EnableIfPod<T>>
+    void Deserialize(Reader& in, T& pod) {
+        in.Read(&pod, sizeof(pod));
+    }
+
+    // Any byte but 0 and 1 would be read as a bool that is neither true nor false.
+    inline void Deserialize(Reader& in, bool& flag) {
+        uint8_t byte;
+        in.Read(&byte, sizeof(byte));
+        Check(byte <= 1, "Serialized data has a bad flag");
+        flag = byte == 1;
+    }
+
+    inline void Deserialize(Reader& in, std::string& str) {
+        str.resize(DeserializeSize(in, 1));
+        in.Read(str.data(), str.size());
+    }
+
+    template <typename T>
+    void Deserialize(Reader& in, std::vector<T>& data) {
+        if constexpr (std::is_trivially_copyable_v<T>) {
+            data.resize(DeserializeSize(in, sizeof(T)));
+            in.Read(data.data(), data.size() * sizeof(T));
+        } else {
+            data.resize(DeserializeSize(in, sizeof(size_t)));
+            for (auto& element : data) {
+                Deserialize(in, element);
+            }
+        }
+    }
+
+
+    // MappedFile
+
+#if defined(__unix__) || defined(__APPLE__)
+    inline MappedFile::MappedFile(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Cannot map " + path);
+            }
+            data_ = static_cast<const char*>(data);
+            mapped_ = true;
+        }
+        close(fd);
+    }
+
+    inline MappedFile::~MappedFile() {
+        if (mapped_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+#else
+    inline MappedFile::MappedFile(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+    }
+
+    inline MappedFile::~MappedFile() {}
+#endif
+
+}
@@ -0,0 +1,317 @@
+#include "server.h"
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+    const int MAX_EVENTS = 256;
+
+    void CloseFd(int& fd) {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    bool Watch(int epoll_fd, int fd, uint64_t id, uint32_t events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.u64 = id;
+        return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+}
+
+Server::Server(const string& socket_path, ThreadPool& pool, Handler handler)
+    : SocketPath(socket_path)
+    , Pool(pool)
+    , RequestHandler(move(handler))
+{
+    sockaddr_un address{};
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw invalid_argument("Socket path is too long: " + socket_path);
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ListenFd < 0) {
+        throw runtime_error("Cannot create a socket");
+    }
+    unlink(socket_path.c_str());
+    if (bind(ListenFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+        || listen(ListenFd, SOMAXCONN) != 0) {
+        CloseFd(ListenFd);
+        throw runtime_error("Cannot listen on " + socket_path);
+    }
+
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    StopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (EpollFd < 0 || StopFd < 0
+        || !Watch(EpollFd, ListenFd, LISTENER_ID, EPOLLIN)
+        || !Watch(EpollFd, StopFd, STOP_EVENT_ID, EPOLLIN)) {
+        CloseFd(StopFd);
+        CloseFd(EpollFd);
+        CloseFd(ListenFd);
+        unlink(socket_path.c_str());
+        throw runtime_error("Cannot set up epoll");
+    }
+}
+
+Server::~Server() {
+    for (auto& [id, connection] : Connections) {
+        close(connection->Fd);
+    }
+    CloseFd(StopFd);
+    CloseFd(EpollFd);
+    CloseFd(ListenFd);
+    unlink(SocketPath.c_str());
+}
+
+void Server::SetUpdateHandler(UpdateFilter is_update, Handler update_handler) {
+    IsUpdate = move(is_update);
+    UpdateHandler = move(update_handler);
+}
+
+void Server::Stop() {
+    const uint64_t one = 1;
+    [[maybe_unused]] const ssize_t written = write(StopFd, &one, sizeof(one));
+}
+
+// Level-triggered: whatever a wakeup leaves unread or unsent is reported again.
+void Server::Run() {
+    epoll_event events[MAX_EVENTS];
+    vector<PendingRequest> requests;
+    vector<uint64_t> active_ids;
+    bool is_stopping = false;
+    while (!is_stopping) {
+        const int event_count = epoll_wait(EpollFd, events, MAX_EVENTS, -1);
+        if (event_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw runtime_error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < event_count; ++i) {
+            const uint64_t id = events[i].data.u64;
+            if (id == LISTENER_ID) {
+                AcceptConnections();
+                continue;
+            }
+            if (id == STOP_EVENT_ID) {
+                is_stopping = true;
+                continue;
+            }
+            // Closed by an earlier event of the same wakeup.
+            const auto it = Connections.find(id);
+            if (it == Connections.end()) {
+                continue;
+            }
+            Connection& connection = *it->second;
+            if ((events[i].events & EPOLLOUT) && !WriteResponses(id, connection)) {
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                && !ReadRequests(id, connection, requests)) {
+                continue;
+            }
+            active_ids.push_back(id);
+        }
+
+        AnswerRequests(requests);
+        requests.clear();
+        for (const uint64_t id : active_ids) {
+            const auto it = Connections.find(id);
+            if (it != Connections.end()) {
+                WriteResponses(id, *it->second);
+            }
+        }
+        active_ids.clear();
+    }
+
+    uint64_t stop_count;
+    [[maybe_unused]] const ssize_t read_size = read(StopFd, &stop_count, sizeof(stop_count));
+}
+
+void Server::AcceptConnections() {
+    while (true) {
+        // Gives up on EAGAIN, when everyone waiting is in, and on errors, which only
+        // lose the client that caused them.
+        const int fd = accept4(ListenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        const uint64_t id = NextConnectionId++;
+        auto connection = make_unique<Connection>();
+        connection->Fd = fd;
+        connection->Events = EPOLLIN | EPOLLRDHUP;
+        if (!Watch(EpollFd, fd, id, connection->Events)) {
+            close(fd);
+            continue;
+        }
+        Connections.emplace(id, move(connection));
+    }
+}
+
+// Reads at most about MAX_REQUEST_SIZE bytes per wakeup, so one busy client cannot
+// hold up the others. A last line without a newline still counts once the client
+// has shut down its side.
+bool Server::ReadRequests(uint64_t connection_id, Connection& connection, vector<PendingRequest>& requests) {
+    const size_t old_size = connection.Input.size();
+    char chunk[READ_CHUNK_SIZE];
+    while (connection.Input.size() - old_size < MAX_REQUEST_SIZE) {
+        const ssize_t received = recv(connection.Fd, chunk, sizeof(chunk), 0);
+        if (received > 0) {
+            connection.Input.append(chunk, received);
+        }
+        else if (received == 0) {
+            connection.IsReadClosed = true;
+            break;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        else {
+            CloseConnection(connection_id);
+            return false;
+        }
+    }
+
+    string& input = connection.Input;
+    size_t line_start = 0;
+    for (size_t line_end = input.find('\n', old_size); line_end != string::npos;
+        line_end = input.find('\n', line_start)) {
+        string_view line(input.data() + line_start, line_end - line_start);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (!line.empty()) {
+            requests.push_back({ connection_id, string(line) });
+        }
+        line_start = line_end + 1;
+    }
+    input.erase(0, line_start);
+    if (connection.IsReadClosed && !input.empty()) {
+        requests.push_back({ connection_id, move(input) });
+        input.clear();
+    }
+    if (input.size() > MAX_REQUEST_SIZE) {
+        CloseConnection(connection_id);
+        return false;
+    }
+    return true;
+}
+
+// Queries between two updates are answered together on the pool.
+void Server::AnswerRequests(const vector<PendingRequest>& requests) {
+    vector<string> responses(requests.size());
+    size_t begin = 0;
+    while (begin < requests.size()) {
+        size_t end = begin;
+        while (end < requests.size() && !(IsUpdate && IsUpdate(requests[end].Line))) {
+            ++end;
+        }
+        Pool.ParallelFor(end - begin, [&](size_t i) {
+            responses[begin + i] = RequestHandler(requests[begin + i].Line);
+        });
+        if (end < requests.size()) {
+            responses[end] = UpdateHandler(requests[end].Line);
+            ++end;
+        }
+        begin = end;
+    }
+
+    for (size_t i = 0; i < requests.size(); ++i) {
+        const auto it = Connections.find(requests[i].ConnectionId);
+        if (it == Connections.end()) {
+            continue;
+        }
+        auto& output = it->second->Output;
+        output += responses[i];
+        output += '\n';
+    }
+}
+
+bool Server::WriteResponses(uint64_t connection_id, Connection& connection) {
+    string& output = connection.Output;
+    while (connection.OutputOffset < output.size()) {
+        const ssize_t sent = send(connection.Fd, output.data() + connection.OutputOffset,
+            output.size() - connection.OutputOffset, MSG_NOSIGNAL);
+        if (sent >= 0) {
+            connection.OutputOffset += sent;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        else {
+            CloseConnection(connection_id);
+            return false;
+        }
+    }
+
+    if (connection.OutputOffset == output.size()) {
+        output.clear();
+        connection.OutputOffset = 0;
+        if (connection.IsReadClosed) {
+            CloseConnection(connection_id);
+            return false;
+        }
+    }
+    else if (connection.OutputOffset > output.size() / 2) {
+        output.erase(0, connection.OutputOffset);
+        connection.OutputOffset = 0;
+    }
+    return UpdateEvents(connection_id, connection);
+}
+
+// Reading stops once the client has shut down its side or lets too much output pile
+// up; writing is watched only while output is waiting.
+bool Server::UpdateEvents(uint64_t connection_id, Connection& connection) {
+    const size_t pending_size = connection.Output.size() - connection.OutputOffset;
+    uint32_t events = 0;
+    if (!connection.IsReadClosed && pending_size <= MAX_PENDING_OUTPUT) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (pending_size > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == connection.Events) {
+        return true;
+    }
+    epoll_event event{};
+    event.events = events;
+    event.data.u64 = connection_id;
+    if (epoll_ctl(EpollFd, EPOLL_CTL_MOD, connection.Fd, &event) != 0) {
+        CloseConnection(connection_id);
+        return false;
+    }
+    connection.Events = events;
+    return true;
+}
+
+void Server::CloseConnection(uint64_t connection_id) {
+    const auto it = Connections.find(connection_id);
+    close(it->second->Fd);
+    Connections.erase(it);
+}
+
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+
+#ifdef __linux__
+
+#include "thread_pool.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Serves requests over a Unix domain socket, one request per line and one response
+// line for each, in order per connection. A single thread waits on epoll for all
+// connections; the request lines gathered in one wakeup are answered together on the
+// pool, so queries from many clients run in parallel while the loop does no more than
+// socket reads and writes.
+class Server {
+public:
+    // Called on pool threads, concurrently; returns the response without the newline.
+    using Handler = std::function<std::string(std::string_view request)>;
+    // Tells requests that change the data from queries; called on the loop thread.
+    using UpdateFilter = std::function<bool(std::string_view request)>;
+
+    // Listens on socket_path, replacing a stale socket file left there.
+    Server(const std::string& socket_path, ThreadPool& pool, Handler handler);
+    ~Server();
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Requests for which is_update holds are answered by update_handler on the loop
+    // thread, with no query running: after every request that arrived before them in
+    // the same wakeup and before every one that arrived after.
+    void SetUpdateHandler(UpdateFilter is_update, Handler update_handler);
+
+    // Serves until Stop() is called.
+    void Run();
+    // Only writes to an eventfd, so it is safe from other threads and signal handlers.
+    void Stop();
+
+private:
+    // A client that sends a line longer than this without a newline is dropped.
+    static const size_t MAX_REQUEST_SIZE = 1 << 20;
+    // Requests from a client that does not read its responses wait in the socket
+    // once this much output is queued for it.
+    static const size_t MAX_PENDING_OUTPUT = 16 << 20;
+    static const size_t READ_CHUNK_SIZE = 64 * 1024;
+    // Ids in epoll events; connections are numbered from FIRST_CONNECTION_ID on, so an
+    // id is never reused even when a file descriptor is.
+    static const uint64_t LISTENER_ID = 0;
+    static const uint64_t STOP_EVENT_ID = 1;
+    static const uint64_t FIRST_CONNECTION_ID = 2;
+
+    struct Connection {
+        int Fd;
+        std::string Input;
+        std::string Output;
+        size_t OutputOffset = 0;
+        // Epoll events the connection is registered for.
+        uint32_t Events = 0;
+        // The client has shut down its side; close once everything is sent.
+        bool IsReadClosed = false;
+    };
+
+    struct PendingRequest {
+        uint64_t ConnectionId;
+        std::string Line;
+    };
+
+    std::string SocketPath;
+    ThreadPool& Pool;
+    Handler RequestHandler;
+    UpdateFilter IsUpdate;
+    Handler UpdateHandler;
+    int ListenFd = -1;
+    int EpollFd = -1;
+    int StopFd = -1;
+    uint64_t NextConnectionId = FIRST_CONNECTION_ID;
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> Connections;
+
+    void AcceptConnections();
+    // These return false when they closed the connection.
+    bool ReadRequests(uint64_t connection_id, Connection& connection, std::vector<PendingRequest>& requests);
+    bool WriteResponses(uint64_t connection_id, Connection& connection);
+    bool UpdateEvents(uint64_t connection_id, Connection& connection);
+    void AnswerRequests(const std::vector<PendingRequest>& requests);
+    void CloseConnection(uint64_t connection_id);
+};
+
+#endif
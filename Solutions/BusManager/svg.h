@@ -1,5 +1,7 @@
 #pragma once
 
+#include <charconv>
+#include <cstdint>
 #include <cstring>
 #include <vector>
 #include <cstdio>
@@ -9,14 +11,51 @@
 #include <memory>
 #include <iostream>
 #include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 
 using namespace std;
 
 namespace Svg {
 
+// Figures render into a string. Numbers go through to_chars with the 12 fixed
+// decimals the renderer has always printed, and attribute names are literals, so
+// their length is known at compile time.
+inline void AppendNumber(string& out, double value) {
+    // Enough for any finite double in fixed notation.
+    char buffer[400];
+    const auto result = to_chars(buffer, buffer + sizeof(buffer), value, chars_format::fixed, 12);
+    out.append(buffer, result.ptr - buffer);
+}
+
+inline void AppendNumber(string& out, int value) {
+    char buffer[16];
+    const auto result = to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr - buffer);
+}
+
+inline void AppendNumber(string& out, uint32_t value) {
+    char buffer[16];
+    const auto result = to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr - buffer);
+}
+
+inline void AppendValue(string& out, string_view value) {
+    out += value;
+}
+
 template <typename T>
-void PrintKeyValue(ostream& os, string key, T value) {
-    os << fixed << setprecision(12) << key << "=\"" << value << "\" ";
+void AppendValue(string& out, T value) {
+    AppendNumber(out, value);
+}
+
+template <size_t N, typename T>
+void PrintKeyValue(string& out, const char (&key)[N], const T& value) {
+    out.append(key, N - 1);
+    out.append("=\"", 2);
+    AppendValue(out, value);
+    out.append("\" ", 2);
 }
 
 struct Point {
@@ -47,9 +86,16 @@ struct Rgba {
     }   
 
     string ToString() const {
-        ostringstream os;
-        os << fixed << setprecision(12) << alpha;
-        return "rgba(" + to_string(red) + "," + to_string(green) + "," + to_string(blue) + "," + os.str() + ")";
+        string result = "rgba(";
+        AppendNumber(result, red);
+        result += ',';
+        AppendNumber(result, green);
+        result += ',';
+        AppendNumber(result, blue);
+        result += ',';
+        AppendNumber(result, alpha);
+        result += ')';
+        return result;
     }
 };
 
@@ -67,26 +113,58 @@ struct Rgb {
     }   
 
     string ToString() const {
-        return "rgb(" + to_string(red) + "," + to_string(green) + "," + to_string(blue) + ")";
+        string result = "rgb(";
+        AppendNumber(result, red);
+        result += ',';
+        AppendNumber(result, green);
+        result += ',';
+        AppendNumber(result, blue);
+        result += ')';
+        return result;
     }
 };
 
+// Formatted once when the color is made, typically per palette entry, and kept in
+// an inline buffer: figures copy it without allocating and render it with a memcpy.
+// Longer values, which no real color needs, are shared on the heap instead.
 class Color {
 public:
-    Color(): Value("none") {}
-    Color(const Rgb& rgb): Value(rgb.ToString()) {}
-    Color(const Rgba& rgba): Value(rgba.ToString()) {}
-    Color(const string& value): Value(value) {}
-    Color(const char* value): Value(string(value)) {}
+    Color() { Assign("none"); }
+    Color(const Rgb& rgb) { Assign(rgb.ToString()); }
+    Color(const Rgba& rgba) { Assign(rgba.ToString()); }
+    Color(const string& value) { Assign(value); }
+    Color(const char* value) { Assign(value); }
     
     string ToString() const {
-        return Value;
+        return string(View());
+    }
+
+    string_view View() const {
+        if (LongValue) {
+            return *LongValue;
+        }
+        return { Value, Size };
     }
 
 private:
-    string Value;
+    static constexpr size_t MAX_INLINE_SIZE = 47;
+
+    char Value[MAX_INLINE_SIZE];
+    uint8_t Size = 0;
+    shared_ptr<const string> LongValue;
+
+    void Assign(string_view value) {
+        if (value.size() > MAX_INLINE_SIZE) {
+            LongValue = make_shared<const string>(value);
+            return;
+        }
+        memcpy(Value, value.data(), value.size());
+        Size = static_cast<uint8_t>(value.size());
+    }
 };
 
+// String attributes are kept as views, so figures do not allocate for them: the
+// text has to outlive rendering, as literals and names owned by the caller do.
 class Figure {
 public:
     void FigSetFillColor(const Color& color) {
@@ -101,23 +179,23 @@ public:
         StrokeWidth = width; 
     }
 
-    void FigSetStrokeLineCap(const string& stroke_line_cap) {
+    void FigSetStrokeLineCap(string_view stroke_line_cap) {
         StrokeLineCap = stroke_line_cap; 
     }
 
-    void FigSetStrokeLineJoin(const string& stroke_line_join) {
+    void FigSetStrokeLineJoin(string_view stroke_line_join) {
         StrokeLineJoin = stroke_line_join;
     }
 
-    virtual void Render(ostream& os) {
-        PrintKeyValue(os, "fill", FillColor.ToString());
-        PrintKeyValue(os, "stroke", StrokeColor.ToString());
-        PrintKeyValue(os, "stroke-width", StrokeWidth);
+    void Render(string& out) const {
+        PrintKeyValue(out, "fill", FillColor.View());
+        PrintKeyValue(out, "stroke", StrokeColor.View());
+        PrintKeyValue(out, "stroke-width", StrokeWidth);
         if (StrokeLineCap) {
-            PrintKeyValue(os, "stroke-linecap", *StrokeLineCap);
+            PrintKeyValue(out, "stroke-linecap", *StrokeLineCap);
         }
         if (StrokeLineJoin) {
-            PrintKeyValue(os, "stroke-linejoin", *StrokeLineJoin);
+            PrintKeyValue(out, "stroke-linejoin", *StrokeLineJoin);
         }
     }
 
@@ -125,8 +203,8 @@ private:
     Color FillColor = Color();
     Color StrokeColor = Color();
     double StrokeWidth = 1.0;
-    optional<string> StrokeLineCap = nullopt;
-    optional<string> StrokeLineJoin = nullopt;
+    optional<string_view> StrokeLineCap = nullopt;
+    optional<string_view> StrokeLineJoin = nullopt;
 };
 
 class Rectangle : public Figure {
@@ -143,14 +221,14 @@ public:
     }
 
 
-    void Render(ostream& os) override {
-        os << "<rect ";
-        Figure::Render(os);
-        PrintKeyValue(os, "x", fix(Position.x));
-        PrintKeyValue(os, "y", fix(Position.y));
-        PrintKeyValue(os, "width", fix(Width));
-        PrintKeyValue(os, "height", fix(Height));
-        os << "/>";
+    void Render(string& out) const {
+        out += "<rect ";
+        Figure::Render(out);
+        PrintKeyValue(out, "x", fix(Position.x));
+        PrintKeyValue(out, "y", fix(Position.y));
+        PrintKeyValue(out, "width", fix(Width));
+        PrintKeyValue(out, "height", fix(Height));
+        out += "/>";
     }
 
     Rectangle& SetFillColor(const Color& color) {
@@ -168,12 +246,12 @@ public:
         return *this;
     }
 
-    Rectangle& SetStrokeLineCap(const string& stroke_line_cap) {
+    Rectangle& SetStrokeLineCap(string_view stroke_line_cap) {
         FigSetStrokeLineCap(stroke_line_cap);
         return *this;
     }
 
-    Rectangle& SetStrokeLineJoin(const string& stroke_line_join) {
+    Rectangle& SetStrokeLineJoin(string_view stroke_line_join) {
         FigSetStrokeLineJoin(stroke_line_join);
         return *this;
     }
@@ -183,7 +261,7 @@ private:
     double Height;
     double Width;
 
-    double fix(double val) {
+    static double fix(double val) {
         if (abs(val) < 1e-9) return 0.0;
         return val;
     }
@@ -201,13 +279,13 @@ public:
         return *this;
     }
 
-    void Render(ostream& os) override {
-        os << "<circle ";
-        Figure::Render(os);
-        PrintKeyValue(os, "cx", Center.x);
-        PrintKeyValue(os, "cy", Center.y);
-        PrintKeyValue(os, "r", Radius);
-        os << "/>";
+    void Render(string& out) const {
+        out += "<circle ";
+        Figure::Render(out);
+        PrintKeyValue(out, "cx", Center.x);
+        PrintKeyValue(out, "cy", Center.y);
+        PrintKeyValue(out, "r", Radius);
+        out += "/>";
     }
     
     Circle& SetFillColor(const Color& color) {
@@ -225,12 +303,12 @@ public:
         return *this;
     }
 
-    Circle& SetStrokeLineCap(const string& stroke_line_cap) {
+    Circle& SetStrokeLineCap(string_view stroke_line_cap) {
         FigSetStrokeLineCap(stroke_line_cap);
         return *this;
     }
 
-    Circle& SetStrokeLineJoin(const string& stroke_line_join) {
+    Circle& SetStrokeLineJoin(string_view stroke_line_join) {
         FigSetStrokeLineJoin(stroke_line_join);
         return *this;
     }
@@ -247,15 +325,18 @@ public:
         return *this;
     }
 
-    void Render(ostream& os) override {
-        os << "<polyline ";
-        Figure::Render(os);
-        os << "points=\"";
+    void Render(string& out) const {
+        out += "<polyline ";
+        Figure::Render(out);
+        out += "points=\"";
         for (const auto& p: Points) {
-            os << p.x << "," << p.y << " ";
+            AppendNumber(out, p.x);
+            out += ',';
+            AppendNumber(out, p.y);
+            out += ' ';
         }
-        os << "\" ";
-        os << "/>";
+        out += "\" ";
+        out += "/>";
     }
 
     Polyline& SetFillColor(const Color& color) {
@@ -273,12 +354,12 @@ public:
         return *this;
     }
 
-    Polyline& SetStrokeLineCap(const string& stroke_line_cap) {
+    Polyline& SetStrokeLineCap(string_view stroke_line_cap) {
         FigSetStrokeLineCap(stroke_line_cap);
         return *this;
     }
 
-    Polyline& SetStrokeLineJoin(const string& stroke_line_join) {
+    Polyline& SetStrokeLineJoin(string_view stroke_line_join) {
         FigSetStrokeLineJoin(stroke_line_join);
         return *this;
     }
@@ -304,36 +385,38 @@ public:
         return *this;
     } 
 
-    Text& SetFontWeight(const string& weight) {
+    Text& SetFontWeight(string_view weight) {
         FontWeight = weight;
         return *this;
     }
 
-    Text& SetFontFamily(const string& font) {
+    Text& SetFontFamily(string_view font) {
         FontFamily = font;
         return *this;
     }
 
-    Text& SetData(const string& data) {
+    Text& SetData(string_view data) {
         Data = data;
         return *this;
     }
 
-    void Render(ostream& os) override {
-        os << "<text ";
-        Figure::Render(os);
-        PrintKeyValue(os, "x", Coords.x);
-        PrintKeyValue(os, "y", Coords.y);
-        PrintKeyValue(os, "dx", Offset.x);
-        PrintKeyValue(os, "dy", Offset.y);
-        PrintKeyValue(os, "font-size", FontSize);
+    void Render(string& out) const {
+        out += "<text ";
+        Figure::Render(out);
+        PrintKeyValue(out, "x", Coords.x);
+        PrintKeyValue(out, "y", Coords.y);
+        PrintKeyValue(out, "dx", Offset.x);
+        PrintKeyValue(out, "dy", Offset.y);
+        PrintKeyValue(out, "font-size", FontSize);
         if (FontFamily) {
-            PrintKeyValue(os, "font-family", *FontFamily);
+            PrintKeyValue(out, "font-family", *FontFamily);
         } 
         if (FontWeight) {
-            PrintKeyValue(os, "font-weight", *FontWeight);
+            PrintKeyValue(out, "font-weight", *FontWeight);
         } 
-        os << ">" << Data << "</text>";
+        out += '>';
+        out += Data;
+        out += "</text>";
     }
 
     Text& SetFillColor(const Color& color) {
@@ -351,12 +434,12 @@ public:
         return *this;
     }
 
-    Text& SetStrokeLineCap(const string& stroke_line_cap) {
+    Text& SetStrokeLineCap(string_view stroke_line_cap) {
         FigSetStrokeLineCap(stroke_line_cap);
         return *this;
     }
 
-    Text& SetStrokeLineJoin(const string& stroke_line_join) {
+    Text& SetStrokeLineJoin(string_view stroke_line_join) {
         FigSetStrokeLineJoin(stroke_line_join);
         return *this;
     }
@@ -365,39 +448,104 @@ private:
     Point Coords = {0.0, 0.0};
     Point Offset = {0.0, 0.0};
     uint32_t FontSize = 1;
-    optional<string> FontFamily = nullopt;
-    optional<string> FontWeight = nullopt;
-    string Data = "";
+    optional<string_view> FontFamily = nullopt;
+    optional<string_view> FontWeight = nullopt;
+    string_view Data;
 };
 
+// Figures are kept by value in one vector per type, and Order records the sequence
+// they were added in, which is also the drawing order. Rendering is a switch over
+// the type, with no virtual calls and no allocation per figure.
 class Document {
 public:
     Document() {}
 
     void Add(Circle circle) {
-        Figures.push_back(make_unique<Circle>(circle));
+        AddToOrder(EFigureType::CIRCLE, Circles.size());
+        Circles.push_back(move(circle));
     }
     void Add(Polyline polyline) {
-        Figures.push_back(make_unique<Polyline>(polyline));
+        AddToOrder(EFigureType::POLYLINE, Polylines.size());
+        Polylines.push_back(move(polyline));
     }
     void Add(Text text) {
-        Figures.push_back(make_unique<Text>(text));
+        AddToOrder(EFigureType::TEXT, Texts.size());
+        Texts.push_back(move(text));
     }
     void Add(Rectangle rect) {
-        Figures.push_back(make_unique<Rectangle>(rect));
+        AddToOrder(EFigureType::RECTANGLE, Rectangles.size());
+        Rectangles.push_back(move(rect));
+    }
+
+    void Render(ostream& os) const {
+        string out;
+        RenderHeader(out);
+        RenderFigures(out);
+        RenderFooter(out);
+        os << out;
+    }
+
+    // The parts of Render(), for documents assembled from separately rendered pieces.
+    static void RenderHeader(string& out) {
+        out += "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>";
+        out += "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\">";
+    }
+
+    size_t Size() const {
+        return Order.size();
+    }
+
+    void RenderFigures(string& out) const {
+        RenderFigures(out, 0, Order.size());
+    }
+
+    // Figures [begin, end) in drawing order, so a document can be rendered in chunks.
+    void RenderFigures(string& out, size_t begin, size_t end) const {
+        for (size_t i = begin; i < end; ++i) {
+            const FigureRef figure = Order[i];
+            switch (figure.Type) {
+                case EFigureType::CIRCLE:
+                    Circles[figure.Index].Render(out);
+                    break;
+                case EFigureType::POLYLINE:
+                    Polylines[figure.Index].Render(out);
+                    break;
+                case EFigureType::TEXT:
+                    Texts[figure.Index].Render(out);
+                    break;
+                case EFigureType::RECTANGLE:
+                    Rectangles[figure.Index].Render(out);
+                    break;
+            }
+        }
     }
 
-    void Render(ostream& os) {
-        os << "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>";
-        os << "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\">";
-        for (const auto& el: Figures) {
-            el->Render(os);
-        }
-        os << "</svg>";
+    static void RenderFooter(string& out) {
+        out += "</svg>";
     }
 
 private:
-    vector<unique_ptr<Figure>> Figures;
+    enum class EFigureType : uint8_t {
+        CIRCLE,
+        POLYLINE,
+        TEXT,
+        RECTANGLE
+    };
+
+    struct FigureRef {
+        EFigureType Type;
+        uint32_t Index;
+    };
+
+    vector<Circle> Circles;
+    vector<Polyline> Polylines;
+    vector<Text> Texts;
+    vector<Rectangle> Rectangles;
+    vector<FigureRef> Order;
+
+    void AddToOrder(EFigureType type, size_t index) {
+        Order.push_back({ type, static_cast<uint32_t>(index) });
+    }
 };
 
 } // namespace
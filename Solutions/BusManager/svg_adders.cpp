@@ -1,74 +1,66 @@
 #include "manager.h"
 
-void BusManager::AddPolylinesToSvg(MapInfo map_info, Svg::Document& svg_doc) {
+void BusManager::AddPolylinesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const {
     using namespace Svg;
-    size_t cur_color_idx = 0;
-    for (const auto& [bus_name, bus] : Buses) {
+    for (const BusId bus_id : BusesByName) {
         Polyline line = Polyline{}
-            .SetStrokeColor(RenderSettings_.color_palette[cur_color_idx])
+            .SetStrokeColor(RenderSettings_.color_palette[map_info.BusColorIdx[bus_id]])
             .SetStrokeWidth(RenderSettings_.line_width)
             .SetStrokeLineCap("round")
             .SetStrokeLineJoin("round");
-        for (const auto stop_name : bus.Stops) {
-            line.AddPoint({
-                map_info[stop_name].lon,
-                map_info[stop_name].lat
-                });
+        for (const StopId stop_id : Buses[bus_id].Stops) {
+            line.AddPoint(map_info.StopPoints[stop_id]);
         }
-        cur_color_idx = (cur_color_idx + 1) % RenderSettings_.color_palette.size();
         svg_doc.Add(line);
     }
 }
 
-void BusManager::AddBusesNamesToSvg(MapInfo map_info, Svg::Document& svg_doc) {
-    using namespace Svg;
-    size_t cur_color_idx = 0;
-    for (auto iter = Buses.begin(); iter != Buses.end(); ++iter) {
-        string bus_name = iter->first;
-        const auto& stops = iter->second.Stops;
-        auto add_stop = [&](const string& stop_name) {
-            Point coords = Point{
-                map_info[stop_name].lon,
-                map_info[stop_name].lat
-            };
-            auto base_settings = Text{}
-                .SetPoint(coords)
-                .SetOffset(RenderSettings_.bus_label_offset)
-                .SetFontSize(RenderSettings_.bus_label_font_size)
-                .SetFontFamily("Verdana")
-                .SetFontWeight("bold")
-                .SetData(bus_name);
-
-            auto underlayer = base_settings;
-            underlayer
-                .SetFillColor(RenderSettings_.underlayer_color)
-                .SetStrokeColor(RenderSettings_.underlayer_color)
-                .SetStrokeWidth(RenderSettings_.underlayer_width)
-                .SetStrokeLineCap("round")
-                .SetStrokeLineJoin("round");
+bool BusManager::IsBusLabelStop(BusId bus_id, StopId stop_id) const {
+    const auto& bus = Buses[bus_id];
+    return stop_id == bus.Stops[0]
+        || (!bus.IsRoundTrip && stop_id == bus.Stops[bus.Stops.size() / 2]);
+}
 
-            auto main_text = base_settings;
-            main_text
-                .SetFillColor(RenderSettings_.color_palette[cur_color_idx]);
+void BusManager::AddBusLabelToSvg(const MapInfo& map_info, Svg::Document& svg_doc, BusId bus_id, StopId stop_id) const {
+    using namespace Svg;
+    auto base_settings = Text{}
+        .SetPoint(map_info.StopPoints[stop_id])
+        .SetOffset(RenderSettings_.bus_label_offset)
+        .SetFontSize(RenderSettings_.bus_label_font_size)
+        .SetFontFamily("Verdana")
+        .SetFontWeight("bold")
+        .SetData(BusNames.GetName(bus_id));
+
+    auto underlayer = base_settings;
+    underlayer
+        .SetFillColor(RenderSettings_.underlayer_color)
+        .SetStrokeColor(RenderSettings_.underlayer_color)
+        .SetStrokeWidth(RenderSettings_.underlayer_width)
+        .SetStrokeLineCap("round")
+        .SetStrokeLineJoin("round");
+
+    auto main_text = base_settings;
+    main_text
+        .SetFillColor(RenderSettings_.color_palette[map_info.BusColorIdx[bus_id]]);
+
+    svg_doc.Add(underlayer);
+    svg_doc.Add(main_text);
+}
 
-            svg_doc.Add(underlayer);
-            svg_doc.Add(main_text);
-        };
-        add_stop(stops[0]);
-        if (!(iter->second.IsRoundTrip) && stops[0] != stops[stops.size() / 2]) {
-            add_stop(stops[stops.size() / 2]);
+void BusManager::AddBusesNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const {
+    for (const BusId bus_id : BusesByName) {
+        const auto& stops = Buses[bus_id].Stops;
+        AddBusLabelToSvg(map_info, svg_doc, bus_id, stops[0]);
+        if (!(Buses[bus_id].IsRoundTrip) && stops[0] != stops[stops.size() / 2]) {
+            AddBusLabelToSvg(map_info, svg_doc, bus_id, stops[stops.size() / 2]);
         }
-        cur_color_idx = (cur_color_idx + 1) % RenderSettings_.color_palette.size();
     }
 }
 
-void BusManager::AddStopCirclesToSvg(MapInfo map_info, Svg::Document& svg_doc) {
+void BusManager::AddStopCirclesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const {
     using namespace Svg;
-    for (const auto& [stop_name, stop] : Stops) {
-        Point coords = Point{
-            map_info[stop_name].lon,
-            map_info[stop_name].lat
-        };
+    for (const StopId stop_id : StopsByName) {
+        Point coords = map_info.StopPoints[stop_id];
         auto circle = Circle{}
             .SetCenter(coords)
             .SetRadius(RenderSettings_.stop_radius)
@@ -77,19 +69,16 @@ void BusManager::AddStopCirclesToSvg(MapInfo map_info, Svg::Document& svg_doc) {
     }
 }
 
-void BusManager::AddStopNamesToSvg(MapInfo map_info, Svg::Document& svg_doc) {
+void BusManager::AddStopNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc) const {
     using namespace Svg;
-    for (const auto& [stop_name, stop] : Stops) {
-        Point coords = Point{
-            map_info[stop_name].lon,
-            map_info[stop_name].lat
-        };
+    for (const StopId stop_id : StopsByName) {
+        Point coords = map_info.StopPoints[stop_id];
         auto base_sets = Text{}
             .SetPoint(coords)
             .SetOffset(RenderSettings_.stop_label_offset)
             .SetFontSize(RenderSettings_.stop_label_font_size)
             .SetFontFamily("Verdana")
-            .SetData(stop_name);
+            .SetData(StopNames.GetName(stop_id));
 
         auto underlayer = base_sets;
         underlayer
@@ -108,7 +97,7 @@ void BusManager::AddStopNamesToSvg(MapInfo map_info, Svg::Document& svg_doc) {
     }
 }
 
-void BusManager::AddOpaqueRectToSvg(Svg::Document& svg_doc) {
+void BusManager::AddOpaqueRectToSvg(Svg::Document& svg_doc) const {
     using namespace Svg;
     Rectangle rect;
     Point left_top = Point{
@@ -125,197 +114,121 @@ void BusManager::AddOpaqueRectToSvg(Svg::Document& svg_doc) {
     svg_doc.Add(rect);
 }
 
-Svg::Document BusManager::BuildMapSvgDocument(MapInfo& map_info) {
-	using namespace Svg; 
-	using namespace Json;
+void BusManager::AddLayerToSvg(const string& layer, const MapInfo& map_info, Svg::Document& svg_doc) const {
+	if (layer == "bus_lines") {
+		AddPolylinesToSvg(map_info, svg_doc);
+	} else if (layer == "bus_labels") {
+		AddBusesNamesToSvg(map_info, svg_doc);
+	} else if (layer == "stop_points") {
+		AddStopCirclesToSvg(map_info, svg_doc); 
+	} else if (layer == "stop_labels") {
+		AddStopNamesToSvg(map_info, svg_doc);
+	}
+}
 
-	Svg::Document svg_doc;
-	for (const auto& layer: RenderSettings_.layers) {
-		if (layer == "bus_lines") {
-			AddPolylinesToSvg(map_info, svg_doc);
-		} else if (layer == "bus_labels") {
-			AddBusesNamesToSvg(map_info, svg_doc);
-		} else if (layer == "stop_points") {
-			AddStopCirclesToSvg(map_info, svg_doc); 
-		} else if (layer == "stop_labels") {
-			AddStopNamesToSvg(map_info, svg_doc);
+// Layers do not depend on each other, so each one is built into a document of its
+// own, and the documents are rendered in chunks of figures. Both steps run on the
+// pool, and the pieces are joined in layer order.
+string BusManager::RenderMapSvg(const MapInfo& map_info) const {
+	using namespace Svg;
+
+	const auto& layers = RenderSettings_.layers;
+	vector<Document> layer_docs(layers.size());
+	ParallelFor(layers.size(), [&](size_t i) {
+		AddLayerToSvg(layers[i], map_info, layer_docs[i]);
+	});
+
+	struct Chunk {
+		const Document* Doc;
+		size_t Begin;
+		size_t End;
+	};
+	vector<Chunk> chunks;
+	for (const auto& doc : layer_docs) {
+		for (size_t begin = 0; begin < doc.Size(); begin += RENDER_CHUNK_SIZE) {
+			chunks.push_back({ &doc, begin, min(begin + RENDER_CHUNK_SIZE, doc.Size()) });
 		}
-	}      
-	return svg_doc;
+	}
+	vector<string> parts(chunks.size());
+	ParallelFor(chunks.size(), [&](size_t i) {
+		chunks[i].Doc->RenderFigures(parts[i], chunks[i].Begin, chunks[i].End);
+	});
+
+	string svg;
+	Document::RenderHeader(svg);
+	size_t total_size = svg.size();
+	for (const auto& part : parts) {
+		total_size += part.size();
+	}
+	svg.reserve(total_size);
+	for (const auto& part : parts) {
+		svg += part;
+	}
+	return svg;
 }
 
 
-void BusManager::AddPathsToSvg(MapInfo map_info, Svg::Document& svg_doc,
-        Graph::Router<double>::RouteInfo& route_info) {
+void BusManager::AddPathsToSvg(const MapInfo& map_info, Svg::Document& svg_doc,
+        const vector<EdgeInfo>& rides) const {
 	using namespace Svg; 
 	using namespace Json;
 	for (const auto& layer: RenderSettings_.layers) {
 		if (layer == "bus_lines") {
-			PathAddPolylinesToSvg(map_info, svg_doc, route_info);
+			PathAddPolylinesToSvg(map_info, svg_doc, rides);
 		} else if (layer == "bus_labels") {
-			PathAddBusesNamesToSvg(map_info, svg_doc, route_info);
+			PathAddBusesNamesToSvg(map_info, svg_doc, rides);
 		} else if (layer == "stop_points") {
-			PathAddStopCirclesToSvg(map_info, svg_doc, route_info); 
+			PathAddStopCirclesToSvg(map_info, svg_doc, rides); 
 		} else if (layer == "stop_labels") {
-			PathAddStopNamesToSvg(map_info, svg_doc, route_info);
+			PathAddStopNamesToSvg(map_info, svg_doc, rides);
 		}
 	}
 }
 
 
-void BusManager::PathAddPolylinesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info) {
+void BusManager::PathAddPolylinesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const {
     using namespace Svg;
 
-    map<string, Polyline> line_by_bus;
-    size_t cur_color_idx = 0;
-    for (const auto& [bus_name, bus] : Buses) {
+    for (const auto& ride : rides) {
         Polyline line = Polyline{}
-            .SetStrokeColor(RenderSettings_.color_palette[cur_color_idx])
+            .SetStrokeColor(RenderSettings_.color_palette[map_info.BusColorIdx[ride.Bus]])
             .SetStrokeWidth(RenderSettings_.line_width)
             .SetStrokeLineCap("round")
             .SetStrokeLineJoin("round");
-        line_by_bus[bus_name] = line;
-        cur_color_idx = (cur_color_idx + 1) % RenderSettings_.color_palette.size();
-    }
-
-    for (size_t i = 0; i < route_info.edge_count; ++i) {
-        auto edge_id = RouteBuilder->GetRouteEdge(route_info.id, i);
-        string bus_name = Edges[edge_id].BusName;
-        string stop_from = Edges[edge_id].StopFrom;
-        string stop_to = Edges[edge_id].StopTo;
-        int span_count = Edges[edge_id].SpanCount;
-        auto& stops = Buses[bus_name].Stops;
-        vector<string> stop_names;
-        for (size_t i = 0; i < stops.size(); ++i) {
-            if (stops[i] == stop_from && i + span_count < stops.size() && stops[i + span_count] == stop_to) {
-                for (size_t j = i; j <= i + span_count; ++j) {
-                    stop_names.push_back(stops[j]);
-                }
-                break;
-            }
-            else if (stops[i] == stop_to && i + span_count < stops.size() && stops[i + span_count] == stop_from) {
-                for (int j = static_cast<int>(i + span_count); j >= static_cast<int>(i); --j) {
-                    stop_names.push_back(stops[j]);
-                }
-                break;
-            }
-        }
-        assert(!stop_names.empty());
-        Polyline line = line_by_bus[Edges[edge_id].BusName];
-        for (auto& stop_name : stop_names) {
-			Point coords = Point{
-				map_info[stop_name].lon,
-				map_info[stop_name].lat
-			};
-            line.AddPoint(coords);
+        for (const StopId stop_id : GetRideStops(ride)) {
+            line.AddPoint(map_info.StopPoints[stop_id]);
         }
         svg_doc.Add(line);
     }
 
 }
 
-void BusManager::PathAddBusesNamesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info) {
-    using namespace Svg;
-
-    map<pair<string, string>, Text> main_text_by_bus_and_stop;
-    map<pair<string, string>, Text> underlayer_by_bus_and_stop; 
-    size_t cur_color_idx = 0;
-    for (auto iter = Buses.begin(); iter != Buses.end(); ++iter) {
-        string bus_name = iter->first;
-        const auto& stops = iter->second.Stops;
-        auto add_stop = [&](const string& stop_name) {
-            Point coords = Point{
-                map_info[stop_name].lon,
-                map_info[stop_name].lat
-            };
-            auto base_settings = Text{}
-                .SetPoint(coords)
-                .SetOffset(RenderSettings_.bus_label_offset)
-                .SetFontSize(RenderSettings_.bus_label_font_size)
-                .SetFontFamily("Verdana")
-                .SetFontWeight("bold")
-                .SetData(bus_name);
-
-            auto underlayer = base_settings;
-            underlayer
-                .SetFillColor(RenderSettings_.underlayer_color)
-                .SetStrokeColor(RenderSettings_.underlayer_color)
-                .SetStrokeWidth(RenderSettings_.underlayer_width)
-                .SetStrokeLineCap("round")
-                .SetStrokeLineJoin("round");
-
-            auto main_text = base_settings;
-            main_text
-                .SetFillColor(RenderSettings_.color_palette[cur_color_idx]);
-
-            main_text_by_bus_and_stop[make_pair(bus_name, stop_name)] = main_text;
-            underlayer_by_bus_and_stop[make_pair(bus_name, stop_name)] = underlayer;
-        };
-        add_stop(stops[0]);
-        if (!(iter->second.IsRoundTrip) && stops[0] != stops[stops.size() / 2]) {
-            add_stop(stops[stops.size() / 2]);
-        }
-        cur_color_idx = (cur_color_idx + 1) % RenderSettings_.color_palette.size();
-    }
-
-
-    for (size_t i = 0; i < route_info.edge_count; ++i) {
-        auto edge_id = RouteBuilder->GetRouteEdge(route_info.id, i);
-        string bus_name = Edges[edge_id].BusName;
-        string stop1 = Edges[edge_id].StopFrom;
-        string stop2 = Edges[edge_id].StopTo;
-        if (main_text_by_bus_and_stop.count(make_pair(bus_name, stop1))) {
-            svg_doc.Add(underlayer_by_bus_and_stop[make_pair(bus_name, stop1)]);
-            svg_doc.Add(main_text_by_bus_and_stop[make_pair(bus_name, stop1)]);
-        }
-        if (main_text_by_bus_and_stop.count(make_pair(bus_name, stop2))) {
-            svg_doc.Add(underlayer_by_bus_and_stop[make_pair(bus_name, stop2)]);
-            svg_doc.Add(main_text_by_bus_and_stop[make_pair(bus_name, stop2)]);
+void BusManager::PathAddBusesNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const {
+    for (const auto& ride : rides) {
+        for (const StopId stop_id : { ride.StopFrom, ride.StopTo }) {
+            if (IsBusLabelStop(ride.Bus, stop_id)) {
+                AddBusLabelToSvg(map_info, svg_doc, ride.Bus, stop_id);
+            }
         }
 	}
 }
 
-void BusManager::PathAddStopCirclesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info) {
+void BusManager::PathAddStopCirclesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const {
     using namespace Svg;
 	auto circle = Circle{}
 		.SetRadius(RenderSettings_.stop_radius)
 		.SetFillColor("white");
 
-    for (size_t i = 0; i < route_info.edge_count; ++i) {
-        auto edge_id = RouteBuilder->GetRouteEdge(route_info.id, i);
-        string bus_name = Edges[edge_id].BusName;
-        string stop_from = Edges[edge_id].StopFrom;
-        string stop_to = Edges[edge_id].StopTo;
-        int span_count = Edges[edge_id].SpanCount;
-        auto& stops = Buses[bus_name].Stops;
-        vector<string> stop_names;
-        for (size_t i = 0; i < stops.size(); ++i) {
-            if (stops[i] == stop_from && i + span_count < stops.size() && stops[i + span_count] == stop_to) {
-                for (size_t j = i; j <= i + span_count; ++j) {
-                    stop_names.push_back(stops[j]);
-                }
-                break;
-            }
-            else if (stops[i] == stop_to && i + span_count < stops.size() && stops[i + span_count] == stop_from) {
-                for (int j = static_cast<int>(i + span_count); j >= static_cast<int>(i); --j) {
-                    stop_names.push_back(stops[j]);
-                }
-                break;
-            }
-        }
-        assert(!stop_names.empty());
-        for (auto& stop_name : stop_names) {
-			Point coords = Point{
-				map_info[stop_name].lon,
-				map_info[stop_name].lat
-			};
+    for (const auto& ride : rides) {
+        for (const StopId stop_id : GetRideStops(ride)) {
+			Point coords = map_info.StopPoints[stop_id];
             circle.SetCenter(coords);
             svg_doc.Add(circle);
         }
     }
 }
 
-void BusManager::PathAddStopNamesToSvg(MapInfo map_info, Svg::Document& svg_doc, Graph::Router<double>::RouteInfo& route_info) {
+void BusManager::PathAddStopNamesToSvg(const MapInfo& map_info, Svg::Document& svg_doc, const vector<EdgeInfo>& rides) const {
     using namespace Svg;
     auto base_sets = Text{}
         .SetOffset(RenderSettings_.stop_label_offset)
@@ -334,26 +247,19 @@ void BusManager::PathAddStopNamesToSvg(MapInfo map_info, Svg::Document& svg_doc,
 	main_text
 		.SetFillColor("black");
 
-    vector<string> stop_names;
-    for (size_t i = 0; i < route_info.edge_count; ++i) {
-        auto edge_id = RouteBuilder->GetRouteEdge(route_info.id, i);
-        string bus_name = Edges[edge_id].BusName;
-        string stop_from = Edges[edge_id].StopFrom;
-        string stop_to = Edges[edge_id].StopTo;
-        if (stop_names.empty()) {
-            stop_names.push_back(stop_from);
+    vector<StopId> stop_ids;
+    for (const auto& ride : rides) {
+        if (stop_ids.empty()) {
+            stop_ids.push_back(ride.StopFrom);
         }
-        stop_names.push_back(stop_to);
+        stop_ids.push_back(ride.StopTo);
     }
-    for (auto& stop_name : stop_names) {
-		Point coords = Point{
-			map_info[stop_name].lon,
-			map_info[stop_name].lat
-		};
+    for (const StopId stop_id : stop_ids) {
+		Point coords = map_info.StopPoints[stop_id];
 		main_text.SetPoint(coords);
-		main_text.SetData(stop_name);
+		main_text.SetData(StopNames.GetName(stop_id));
 		underlayer.SetPoint(coords);
-		underlayer.SetData(stop_name);
+		underlayer.SetData(StopNames.GetName(stop_id));
 		svg_doc.Add(underlayer);
 		svg_doc.Add(main_text);
 	}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Fixed set of worker threads for data-parallel loops. The thread that calls
+// ParallelFor() works on the loop too and only waits for items already taken by
+// others, so a loop body may start a nested ParallelFor() without deadlocking even
+// when every worker is busy.
+class ThreadPool {
+public:
+    // thread_count counts the calling thread, so 1 means no workers at all.
+    explicit ThreadPool(size_t thread_count = thread::hardware_concurrency()) {
+        const size_t worker_count = max<size_t>(thread_count, 1) - 1;
+        Workers.reserve(worker_count);
+        for (size_t i = 0; i < worker_count; ++i) {
+            Workers.emplace_back([this] { RunWorker(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(Mutex);
+            Stopping = true;
+        }
+        HasTasks.notify_all();
+        for (auto& worker : Workers) {
+            worker.join();
+        }
+    }
+
+    size_t GetThreadCount() const {
+        return Workers.size() + 1;
+    }
+
+    // Calls func(i) for every i in [0, count) and returns when all calls are done.
+    // The first exception thrown by func is rethrown here.
+    template <typename Func>
+    void ParallelFor(size_t count, Func func) {
+        if (count == 0) {
+            return;
+        }
+        if (count == 1 || Workers.empty()) {
+            for (size_t i = 0; i < count; ++i) {
+                func(i);
+            }
+            return;
+        }
+
+        auto loop = make_shared<Loop>();
+        loop->Count = count;
+        loop->Body = [&func](size_t i) { func(i); };
+
+        const size_t helper_count = min(Workers.size(), count - 1);
+        {
+            lock_guard<mutex> lock(Mutex);
+            for (size_t i = 0; i < helper_count; ++i) {
+                Tasks.push_back(loop);
+            }
+        }
+        if (helper_count == 1) {
+            HasTasks.notify_one();
+        } else {
+            HasTasks.notify_all();
+        }
+
+        loop->Run();
+
+        unique_lock<mutex> lock(loop->Mutex);
+        loop->AllDone.wait(lock, [&loop] { return loop->DoneCount == loop->Count; });
+        if (loop->Error) {
+            rethrow_exception(loop->Error);
+        }
+    }
+
+private:
+    // A helper that picks up a loop after its items ran out returns without touching
+    // Body, which may refer to a stack frame that is already gone.
+    struct Loop {
+        size_t Count = 0;
+        function<void(size_t)> Body;
+        atomic<size_t> NextIndex = 0;
+
+        mutex Mutex;
+        condition_variable AllDone;
+        size_t DoneCount = 0;
+        exception_ptr Error;
+
+        void Run() {
+            size_t done_here = 0;
+            exception_ptr error;
+            for (size_t i = NextIndex++; i < Count; i = NextIndex++) {
+                if (!error) {
+                    try {
+                        Body(i);
+                    } catch (...) {
+                        error = current_exception();
+                    }
+                }
+                ++done_here;
+            }
+            if (done_here == 0) {
+                return;
+            }
+
+            lock_guard<mutex> lock(Mutex);
+            if (error && !Error) {
+                Error = error;
+            }
+            DoneCount += done_here;
+            if (DoneCount == Count) {
+                AllDone.notify_all();
+            }
+        }
+    };
+
+    vector<thread> Workers;
+    mutex Mutex;
+    condition_variable HasTasks;
+    deque<shared_ptr<Loop>> Tasks;
+    bool Stopping = false;
+
+    void RunWorker() {
+        while (true) {
+            shared_ptr<Loop> loop;
+            {
+                unique_lock<mutex> lock(Mutex);
+                HasTasks.wait(lock, [this] { return Stopping || !Tasks.empty(); });
+                if (Tasks.empty()) {
+                    return;
+                }
+                loop = move(Tasks.front());
+                Tasks.pop_front();
+            }
+            loop->Run();
+        }
+    }
+};